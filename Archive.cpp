@@ -3,47 +3,266 @@
 //
 
 #include "Archive.hpp"
+#include <fcntl.h>
+#include <unistd.h>
 
 namespace ECE141 {
 
-    Archive::Archive(const std::string &aFullPath, AccessMode aMode){
-        auto newFileMode = std::fstream::binary | std::fstream::in | std::fstream::out | std::fstream::trunc;
-        auto existingFileMode = std::fstream::binary | std::fstream::in | std::fstream::out | std::fstream::app;
+    Archive::Archive(const std::string &aFullPath, AccessMode aMode, size_t aBlockSize) : arcNumBlocks(0), arcIsDirty(false), arcCompactorStop(false),
+                                                                                      arcNextNameId(0), arcPoolBytes(0){
         arcPath = aFullPath;
         if(aFullPath.find(".arc") == std::string::npos){
             arcPath = aFullPath + ".arc";
         }
         switch(aMode){
             case AccessMode::AsNew:
-                arcFileStream.open(arcPath, newFileMode);
+                arcFile.open(arcPath, true);
                 arcNumBlocks = 0;
+                arcBlockHandler.blockSize = aBlockSize;
+                arcIsDirty = true; // forces flush to lay down the superblock and an empty index
+                flush();
                 break;
-            case AccessMode::AsExisting:
-                arcFileStream.open(arcPath, existingFileMode);
-                if(!arcFileStream.is_open()){throw std::runtime_error("Failed to open archive");}
-                arcNumBlocks = getStreamNumBlocks(arcFileStream) - 1;
-                reconstructTOC();
+            case AccessMode::AsExisting: {
+                arcFile.open(arcPath, false);
+                if(!arcFile.isOpen()){throw std::runtime_error("Failed to open archive");}
+                auto theStatus = arcBlockHandler.getSuperblock(*this);
+                if(!theStatus.isOK()){throw std::runtime_error("Not an archive");}
+                arcSuperblock = theStatus.getValue();
+                if(!isValidBlockSize(arcSuperblock.blockSize)){throw std::runtime_error("Bad block size");}
+                arcBlockHandler.blockSize = arcSuperblock.blockSize;
+                size_t theFileLen = arcFile.getSize();
+                if(!loadIndex(theFileLen)){
+                    // recovery path: the index is missing or stale, so rebuild it from the block headers
+                    size_t theDataEnd = theFileLen;
+                    if(arcSuperblock.isClean && arcSuperblock.indexOffset <= theFileLen){
+                        theDataEnd = arcSuperblock.indexOffset;
+                    }
+                    arcNumBlocks = theDataEnd > kSuperblockSize ? (theDataEnd - kSuperblockSize) / getBlockSize() : 0;
+                    reconstructTOC();
+                    markDirty(); // the rebuilt index gets persisted on flush
+                }
                 break;
+            }
         }
         arcFolder = static_cast<std::filesystem::path>(arcPath).parent_path();
     }
 
     Archive::~Archive(){
-        if(arcFileStream.is_open()){arcFileStream.close();}
+        stopCompactor();
+        if(arcFile.isOpen()){
+            if(arcIsDirty){flush();}
+            arcFile.close();
+        }
     }
 
     void Archive::reconstructTOC() {
+        std::lock_guard<std::recursive_mutex> theLock(arcOperationMutex);
+        arcTOC.clear();
+        arcChunks.mapChunks.clear();
+        // built aside and swapped in, so getFragmentation() isn't held up by the scan
+        FreeSpaceMap theFreeSpace;
+        theFreeSpace.reset(arcNumBlocks);
+        // collect the chain links of every live block (reading headers in place), grouped by name id, then walk each
+        // chain from its head
+        std::map<uint32_t, std::map<size_t, size_t>> theChains;
+        uint32_t theLastNameId = 0;
         for(size_t i=0; i<arcNumBlocks; i++){
-            Block aBlock;
-            arcBlockHandler.getAsBlock(aBlock, 0, arcFileStream, i, *this, StreamType::Archive);
-            if(!aBlock.header.isEmpty){
-                arcTOC.mapTOC.insert(std::pair<std::string, size_t>(std::string(aBlock.header.blockFileName), aBlock.header.blockIndex));
+            auto theView = arcBlockHandler.getBlockView(i, *this);
+            if(!theView.isOK()){ break; }
+            const Header* theHeader = theView.getValue().header;
+            if(!theHeader->isEmpty){
+                theChains[theHeader->nameId][i] = theHeader->nextBlockIndex;
+                if(theHeader->nameId != kChunkNameId){ theLastNameId = std::max<uint32_t>(theLastNameId, theHeader->nameId); }
+            }
+            else{ theFreeSpace.release(i); }
+        }
+        {
+            std::lock_guard<std::mutex> theAllocationLock(arcAllocationMutex);
+            arcFreeSpace = theFreeSpace;
+        }
+        arcNextNameId = theLastNameId + 1;
+        for(auto& [theNameId, theLinks]: theChains){
+            std::set<size_t> theHeads;
+            for(auto& theLink: theLinks){ theHeads.insert(theLink.first); }
+            for(auto& theLink: theLinks){
+                if(theLink.second != theLink.first){ theHeads.erase(theLink.second); }
+            }
+            // every chunk shares one id, so that group has a head per chunk; a file has one
+            if(theHeads.size() > 1 && theNameId != kChunkNameId){ theHeads.erase(std::next(theHeads.begin()), theHeads.end()); }
+            for(size_t theHead: theHeads){
+                TOCEntry theEntry;
+                size_t theBlockIndex = theHead;
+                for(size_t theSteps=0; theSteps<theLinks.size(); theSteps++){
+                    theEntry.addBlock(theBlockIndex);
+                    theEntry.storedSize += arcBlockHandler.getBlockView(theBlockIndex, *this).getValue().header->blockDataLen;
+                    auto theNext = theLinks.find(theBlockIndex);
+                    if(theNext == theLinks.end() || theNext->second == theBlockIndex ||
+                       !theLinks.count(theNext->second)){ break; }
+                    theBlockIndex = theNext->second;
+                }
+                if(theNameId != kChunkNameId){
+                    // the name length and the name head the file's stream
+                    std::string theRecord;
+                    size_t theRecordSize = kNameLengthSize;
+                    auto theStatus = visitRaw(theEntry, 0, [&](const char* aData, size_t aLength){
+                        while(aLength && theRecord.size() < theRecordSize){
+                            size_t theTaken = std::min(aLength, theRecordSize - theRecord.size());
+                            theRecord.append(aData, theTaken);
+                            aData += theTaken;
+                            aLength -= theTaken;
+                            if(theRecordSize == kNameLengthSize && theRecord.size() == kNameLengthSize){
+                                LittleEndian<uint32_t> theLength;
+                                std::memcpy(&theLength, theRecord.data(), kNameLengthSize);
+                                theRecordSize += theLength;
+                            }
+                        }
+                        return theRecord.size() < theRecordSize;
+                    });
+                    // the name itself is damaged
+                    if(!theStatus.isOK() || theRecord.size() != theRecordSize || theRecordSize == kNameLengthSize){ continue; }
+                    theEntry.nameLength = static_cast<uint32_t>(theRecordSize - kNameLengthSize);
+                    theEntry.storedSize -= std::min<uint64_t>(theEntry.storedSize, theEntry.getNameRecordSize());
+                    arcTOC.addEntry(std::string_view(theRecord).substr(kNameLengthSize), theEntry);
+                    continue;
+                }
+                // a chunk: hash the contents again to get its digest
+                Sha256 theHash;
+                auto theStatus = visitStored(theEntry, 0, [&theHash](const char* aData, size_t aLength){
+                    theHash.update(aData, aLength);
+                    return true;
+                });
+                if(!theStatus.isOK()){ continue; } // a damaged chunk; the recipes using it fail to extract
+                ChunkEntry theChunk;
+                theChunk.blocks = theEntry;
+                arcChunks.mapChunks.emplace(theHash.finish(), theChunk);
+            }
+        }
+        // reference counts follow from the recipes; chunks that no recipe names (an add that never finished) are freed
+        for(auto [theName, theEntry]: arcTOC){
+            if(!isDeduplicated(theEntry)){ continue; }
+            visitRecipe(theEntry, [this](const std::string &aDigest){
+                if(ChunkEntry* theChunk = arcChunks.getEntry(aDigest)){ theChunk->refCount++; }
+            });
+        }
+        for(auto theChunk = arcChunks.mapChunks.begin(); theChunk != arcChunks.mapChunks.end();){
+            if(theChunk->second.refCount){
+                ++theChunk;
+                continue;
             }
+            releaseExtents(theChunk->second.blocks.extents);
+            theChunk = arcChunks.mapChunks.erase(theChunk);
+        }
+    }
+
+    std::vector<Extent> Archive::allocateExtents(size_t aCount){
+        std::lock_guard<std::mutex> theLock(arcAllocationMutex);
+        std::vector<Extent> theExtents;
+        if(auto theStart = arcFreeSpace.findRun(aCount)){
+            Extent theExtent{*theStart, aCount};
+            arcFreeSpace.claim(theExtent);
+            theExtents.push_back(theExtent);
+            return theExtents;
+        }
+        auto appendExtent = [&theExtents](const Extent &anExtent){
+            if(!theExtents.empty() && theExtents.back().getEnd() == anExtent.start){
+                theExtents.back().count += anExtent.count;
+            }
+            else{ theExtents.push_back(anExtent); }
+        };
+        // no hole is large enough: fill the holes first so the archive only grows by what is left over
+        while(aCount && arcFreeSpace.getFreeCount()){
+            Extent theExtent = arcFreeSpace.allocateRun(aCount);
+            appendExtent(theExtent);
+            aCount -= theExtent.count;
+        }
+        if(aCount){
+            appendExtent(Extent{arcNumBlocks, aCount});
+            arcNumBlocks += aCount;
+            arcFreeSpace.resize(arcNumBlocks);
+        }
+        return theExtents;
+    }
+
+    void Archive::releaseExtents(const std::vector<Extent> &anExtents){
+        std::lock_guard<std::mutex> theLock(arcAllocationMutex);
+        for(auto& theExtent: anExtents){ arcFreeSpace.release(theExtent); }
+        // free blocks at the end would only be padding, so the archive gives them up (the file shrinks on flush)
+        size_t theNumBlocks = arcNumBlocks;
+        while(theNumBlocks && arcFreeSpace.isFree(theNumBlocks - 1)){ theNumBlocks--; }
+        if(theNumBlocks < arcNumBlocks){
+            arcNumBlocks = theNumBlocks;
+            arcFreeSpace.truncate(theNumBlocks);
+        }
+    }
+
+    bool Archive::loadIndex(size_t aFileLength){
+        // the index is only trusted if it was written by a clean flush and sits right after the last data block
+        if(!arcSuperblock.isClean){ return false; }
+        size_t theDataEnd = arcBlockHandler.getBlockOffset(arcSuperblock.numBlocks);
+        if(arcSuperblock.indexOffset != theDataEnd ||
+           arcSuperblock.indexOffset + arcSuperblock.indexLength != aFileLength){ return false; }
+        std::string theBuffer;
+        if(!arcBlockHandler.readRegion(theBuffer, arcSuperblock.indexOffset, arcSuperblock.indexLength, *this).isOK()){
+            return false;
+        }
+        auto theChecksum = crc32(0L, reinterpret_cast<const Bytef*>(theBuffer.data()), theBuffer.size());
+        size_t thePos = 0;
+        uint32_t theNextNameId = 0;
+        if(theChecksum != arcSuperblock.indexChecksum || !arcTOC.deserialize(theBuffer, thePos) ||
+           !arcFreeSpace.deserialize(theBuffer, thePos) || !arcChunks.deserialize(theBuffer, thePos) ||
+           !readValue(theBuffer, thePos, theNextNameId) || thePos != theBuffer.size() || arcFreeSpace.numBlocks != arcSuperblock.numBlocks){
+            arcTOC.clear();
+            arcChunks.mapChunks.clear();
+            arcFreeSpace.reset(0);
+            return false;
+        }
+        arcNumBlocks = arcSuperblock.numBlocks;
+        arcNextNameId = theNextNameId;
+        return true;
+    }
+
+    void Archive::markDirty(){
+        if(arcIsDirty){ return; }
+        arcIsDirty = true;
+        arcSuperblock.isClean = 0;
+        arcBlockHandler.writeSuperblock(arcSuperblock, *this);
+        // drop the now stale index so that the file only holds the superblock and data blocks until the next flush
+        arcFile.truncate(arcBlockHandler.getBlockOffset(arcNumBlocks));
+    }
+
+    ArchiveStatus<bool> Archive::flush(){
+        std::lock_guard<std::recursive_mutex> theLock(arcOperationMutex);
+        // headers gathered in the buffer pool have to be on disk before a clean superblock vouches for them
+        if(!arcFile.flushPool()){ return ArchiveStatus<bool>(ArchiveErrors::fileWriteError); }
+        std::string theIndex;
+        arcTOC.serialize(theIndex);
+        arcFreeSpace.serialize(theIndex);
+        arcChunks.serialize(theIndex);
+        appendValue(theIndex, arcNextNameId.load());
+        size_t theIndexOffset = arcBlockHandler.getBlockOffset(arcNumBlocks);
+        // write the index first so that a crash in between leaves a dirty superblock rather than a bad index
+        if(!arcBlockHandler.writeRegion(theIndex, theIndexOffset, *this).isOK()){
+            return ArchiveStatus<bool>(ArchiveErrors::fileWriteError);
+        }
+        arcFile.truncate(theIndexOffset + theIndex.size());
+        arcSuperblock.isClean = 1;
+        arcSuperblock.blockSize = getBlockSize();
+        arcSuperblock.numBlocks = arcNumBlocks;
+        arcSuperblock.indexOffset = theIndexOffset;
+        arcSuperblock.indexLength = theIndex.size();
+        arcSuperblock.indexChecksum = crc32(0L, reinterpret_cast<const Bytef*>(theIndex.data()), theIndex.size());
+        if(!arcBlockHandler.writeSuperblock(arcSuperblock, *this).isOK()){
+            return ArchiveStatus<bool>(ArchiveErrors::fileWriteError);
         }
+        arcIsDirty = false;
+        return ArchiveStatus<bool>(true);
     }
 
-    ArchiveStatus<std::shared_ptr<Archive>> Archive::createArchive(const std::string &anArchiveName){
-        auto theArcPtr = std::shared_ptr<Archive>(new Archive(anArchiveName, AccessMode::AsNew));
+    ArchiveStatus<std::shared_ptr<Archive>> Archive::createArchive(const std::string &anArchiveName, size_t aBlockSize){
+        if(!isValidBlockSize(aBlockSize)){
+            return ArchiveStatus<std::shared_ptr<Archive>>(ArchiveErrors::badBlockLength);
+        }
+        auto theArcPtr = std::shared_ptr<Archive>(new Archive(anArchiveName, AccessMode::AsNew, aBlockSize));
         auto theStatus = ArchiveStatus(theArcPtr);
         return theStatus;
     }
@@ -64,16 +283,21 @@ namespace ECE141 {
         }
     }
 
-    size_t getStreamNumBlocks(std::fstream& aStream, StreamType theStreamType){
+    bool isValidBlockSize(size_t aBlockSize){
+        bool isPowerOfTwo = aBlockSize && !(aBlockSize & (aBlockSize - 1));
+        return isPowerOfTwo && aBlockSize >= kSmallestBlockSize && aBlockSize <= kLargestBlockSize;
+    }
+
+    size_t getStreamNumBlocks(std::fstream& aStream, StreamType theStreamType, size_t aBlockSize){
         aStream.seekp(0, std::ios::end); // set ptr to end
         size_t fileLen = aStream.tellp();
         size_t numBlocksNeeded;
         switch (theStreamType){
             case StreamType::Archive:
-                numBlocksNeeded = (fileLen / kBlockSize) + 1;
+                numBlocksNeeded = (fileLen / aBlockSize) + 1;
                 break;
             case StreamType::NonArchive:
-                numBlocksNeeded = (fileLen / (kBlockSize - headerSize)) + 1;
+                numBlocksNeeded = (fileLen / (aBlockSize - headerSize)) + 1;
         }
 
         aStream.seekp(0, std::ios::beg); // reset to beginning
@@ -82,10 +306,9 @@ namespace ECE141 {
 
     std::vector<Block> BlockHandler::getProcessedBlocks(Archive& theArchive){
         std::vector<Block> processedBlocks;
-        theArchive.arcFileStream.seekp(0, std::ios::end); // set ptr to end
         for(size_t i=0; i<theArchive.arcNumBlocks; i++){
-            Block aBlock;
-            getAsBlock(aBlock, 0, theArchive.arcFileStream, i, theArchive, StreamType::Archive);
+            Block aBlock(blockSize);
+            getAsBlock(aBlock, i, theArchive);
             if(aBlock.header.isProcessed){
                 processedBlocks.push_back(aBlock);
             }
@@ -93,269 +316,1856 @@ namespace ECE141 {
         return processedBlocks;
     }
 
-    Header::Header() : blockIndex(-1), nextBlockIndex(-1), blockDataLen(0), isEmpty(false), isProcessed(false)
+    Superblock::Superblock() : version(kArchiveVersion), isClean(0), blockSize(kBlockSize), numBlocks(0), indexOffset(kSuperblockSize),
+                               indexLength(0), indexChecksum(0)
+    {
+        std::memcpy(magic, kArchiveMagic, sizeof(magic));
+    }
+
+    Header::Header() : blockIndex(-1), nextBlockIndex(-1), blockDataLen(0), nameId(kChunkNameId),
+                       checksum(0), isEmpty(false), isProcessed(false)
     {
-        std::memset(blockFileName, nullChar, sizeof(blockFileName));
         std::memset(processorType, nullChar, sizeof(processorType));
     }
 
-    ProcessorType BlockHandler::getProcessorType(const char* processorName){
-        std::map<const char*, ProcessorType> theProcessorMap = {
-                {"comp",ProcessorType::Compression}
+    ArchiveStatus<ProcessorType> BlockHandler::getProcessorType(const char* processorName){
+        static const std::map<std::string, ProcessorType> theProcessorMap = {
+                {"comp",ProcessorType::Compression},
+                {"dedp",ProcessorType::Deduplication}
         };
-        return theProcessorMap[processorName];
+        auto theType = theProcessorMap.find(std::string(processorName, strnlen(processorName, kProcessorTypeNameSize)));
+        if(theType == theProcessorMap.end()){ return ArchiveStatus<ProcessorType>(ArchiveErrors::badProcessor); }
+        return ArchiveStatus<ProcessorType>(theType->second);
+    }
+
+    ArchiveStatus<std::shared_ptr<IDataProcessor>> BlockHandler::getProcessor(const char* processorName, Archive& theArchive){
+        auto theType = getProcessorType(processorName);
+        if(!theType.isOK()){ return ArchiveStatus<std::shared_ptr<IDataProcessor>>(theType.getError()); }
+        std::shared_ptr<IDataProcessor> theProcessor;
+        switch (theType.getValue()) {
+            case ProcessorType::Compression:
+                theProcessor = std::make_shared<Compression>();
+                break;
+            case ProcessorType::Deduplication:
+                theProcessor = std::make_shared<Deduplication>(theArchive);
+                break;
+        }
+        return ArchiveStatus<std::shared_ptr<IDataProcessor>>(theProcessor);
+    }
+
+    size_t BlockHandler::getBlockOffset(size_t arcPos){
+        return kSuperblockSize + arcPos * blockSize;
+    }
+
+    ArchiveStatus<Superblock> BlockHandler::getSuperblock(Archive& theArchive){
+        Superblock theSuperblock;
+        bool theReadOK = theArchive.arcFile.readAt(reinterpret_cast<char *>(&theSuperblock), sizeof(theSuperblock), 0);
+        // headers of other versions are laid out differently, so not even the recovery scan could read them
+        if(!theReadOK || std::memcmp(theSuperblock.magic, kArchiveMagic, sizeof(kArchiveMagic)) != 0 ||
+           theSuperblock.version != kArchiveVersion){
+            return ArchiveStatus<Superblock>(ArchiveErrors::badArchive);
+        }
+        return ArchiveStatus<Superblock>(theSuperblock);
+    }
+
+    ArchiveStatus<bool> BlockHandler::writeSuperblock(Superblock &aSuperblock, Archive& theArchive){
+        if(!theArchive.arcFile.writeAt(reinterpret_cast<const char*>(&aSuperblock), sizeof(aSuperblock), 0)){
+            return ArchiveStatus<bool>(ArchiveErrors::fileWriteError);
+        }
+        return ArchiveStatus<bool>(true);
+    }
+
+    ArchiveStatus<bool> BlockHandler::readRegion(std::string &aBuffer, size_t anOffset, size_t aLength, Archive& theArchive){
+        aBuffer.resize(aLength);
+        if(!theArchive.arcFile.readAt(aBuffer.data(), aLength, anOffset)){
+            return ArchiveStatus<bool>(ArchiveErrors::fileReadError);
+        }
+        return ArchiveStatus<bool>(true);
+    }
+
+    ArchiveStatus<bool> BlockHandler::writeRegion(const std::string &aBuffer, size_t anOffset, Archive& theArchive){
+        if(!theArchive.arcFile.writeAt(aBuffer.data(), aBuffer.size(), anOffset)){
+            return ArchiveStatus<bool>(ArchiveErrors::fileWriteError);
+        }
+        return ArchiveStatus<bool>(true);
     }
 
     ArchiveStatus<Block> BlockHandler::getAsBlock(Block &aBlock, size_t streamPos, std::fstream& anFStream, size_t arcPos, Archive& theArchive, StreamType theStreamType) {
-        auto theTest= sizeof(aBlock);
         if(theStreamType == StreamType::Archive){
-            theArchive.arcFileStream.seekp(arcPos * kBlockSize); // at the header
-            auto currLoc = theArchive.arcFileStream.tellp();
-            theArchive.arcFileStream.read(reinterpret_cast<char *>(&aBlock), sizeof(aBlock));
-            theArchive.arcFileStream.clear();
-        }
-        else{ // in a normal filestream, there is no header data
-            // first fill the block data with nulls so that there is no undefined behaviour
-            std::memset(aBlock.data, nullChar, kBlockSize - sizeof(aBlock.header));
-            auto theStartPtrloc = anFStream.tellp();
-            anFStream.read((char *) aBlock.data, kBlockSize - sizeof(aBlock.header));
-            aBlock.header.blockDataLen = anFStream.gcount();
-            aBlock.header.isEmpty = false; // note: this is already false when the Header object is initialized
-            // , so we don't need to explicitly set any indicators to false e.g. isCompressed
-            anFStream.clear();
+            return getAsBlock(aBlock, arcPos, theArchive);
         }
+        // in a normal filestream, there is no header data
+        // first fill the block data with nulls so that there is no undefined behaviour
+        aBlock.data.resize(getPayloadSize());
+        std::fill(aBlock.data.begin(), aBlock.data.end(), nullChar);
+        anFStream.read(aBlock.data.data(), aBlock.data.size());
+        aBlock.header.blockDataLen = anFStream.gcount();
+        aBlock.header.isEmpty = false; // note: this is already false when the Header object is initialized
+        // , so we don't need to explicitly set any indicators to false e.g. isCompressed
+        anFStream.clear();
         return ArchiveStatus<Block>(aBlock);
     }
 
+    ArchiveStatus<Block> BlockHandler::getAsBlock(Block &aBlock, size_t arcPos, Archive& theArchive){
+        auto theView = getBlockView(arcPos, theArchive);
+        if(!theView.isOK()){ return ArchiveStatus<Block>(theView.getError()); }
+        if(!isBlockIntact(reinterpret_cast<const char*>(theView.getValue().header))){
+            return ArchiveStatus<Block>(ArchiveErrors::badBlockHash);
+        }
+        aBlock.header = *theView.getValue().header;
+        aBlock.data.assign(theView.getValue().data, theView.getValue().data + getPayloadSize());
+        return ArchiveStatus<Block>(aBlock);
+    }
+
+    ArchiveStatus<BlockView> BlockHandler::getBlockView(size_t arcPos, Archive& theArchive){
+        auto theRun = getBlockRun(arcPos, 1, theArchive);
+        if(!theRun.isOK()){ return ArchiveStatus<BlockView>(theRun.getError()); }
+        const char* theRawBlock = theRun.getValue().data;
+        return ArchiveStatus<BlockView>(BlockView{reinterpret_cast<const Header*>(theRawBlock), theRawBlock + headerSize,
+                                                  theRun.getValue().pin});
+    }
+
+    ArchiveStatus<BlockRun> BlockHandler::getBlockRun(size_t arcPos, size_t aCount, Archive& theArchive){
+        size_t theOffset = getBlockOffset(arcPos);
+        size_t theLength = aCount * blockSize;
+        if(const char* theView = theArchive.arcFile.getView(theOffset, theLength)){
+            return ArchiveStatus<BlockRun>(BlockRun{theView, aCount, {}});
+        }
+        if(BufferPool* thePool = theArchive.arcFile.getPool()){
+            // pages are whole multiples of the block size and start where the blocks do
+            size_t theBlocksPerPage = thePool->getPageSize() / blockSize;
+            if(auto thePin = thePool->pin(arcPos / theBlocksPerPage)){
+                size_t theInPage = arcPos % theBlocksPerPage;
+                size_t theCount = std::min(aCount, theBlocksPerPage - theInPage);
+                return ArchiveStatus<BlockRun>(BlockRun{thePin.getData() + theInPage * blockSize, theCount, thePin});
+            }
+        }
+        readBuffer.resize(theLength);
+        if(!theArchive.arcFile.readAt(readBuffer.data(), theLength, theOffset)){
+            return ArchiveStatus<BlockRun>(ArchiveErrors::fileReadError);
+        }
+        return ArchiveStatus<BlockRun>(BlockRun{readBuffer.data(), aCount, {}});
+    }
+
+    bool BlockHandler::isBlockIntact(const char* aRawBlock) const{
+        const Header &theHeader = *reinterpret_cast<const Header*>(aRawBlock);
+        if(!shouldVerify || theHeader.isEmpty){ return true; }
+        size_t theLength = theHeader.blockDataLen;
+        return theLength <= getPayloadSize() && crc32c(aRawBlock + headerSize, theLength) == theHeader.checksum;
+    }
+
     bool BlockHandler::isBlockEmpty(Block &aBlock, size_t aPos){
         return aBlock.header.isEmpty;
     }
 
-    std::vector<Block> BlockHandler::getEmptyBlocks(Archive& theArchive){
-        std::vector<Block> emptyBlocks;
-        bool allFound = false;
-        for(size_t thePos=0; thePos<theArchive.arcNumBlocks; thePos++){
-            Block aBlock;
-            auto theStatus = getAsBlock(aBlock, thePos, theArchive.arcFileStream, thePos, theArchive,
-                                        StreamType::Archive);
-            aBlock = theStatus.getValue();
-            if(isBlockEmpty(aBlock, thePos)){
-                emptyBlocks.push_back(aBlock);
+    ArchiveStatus<bool> BlockHandler::writeHeader(const Header &aHeader, size_t arcPos, Archive& theArchive){
+        if(BufferPool* thePool = theArchive.arcFile.getPool()){
+            // relinking rewrites the same few headers over and over, so they are gathered in the pool
+            size_t theBlocksPerPage = thePool->getPageSize() / blockSize;
+            if(auto thePin = thePool->pin(arcPos / theBlocksPerPage)){
+                size_t theInPage = (arcPos % theBlocksPerPage) * blockSize;
+                std::memcpy(thePin.getData() + theInPage, &aHeader, sizeof(aHeader));
+                thePool->markDirty(thePin, theInPage, sizeof(aHeader));
+                return ArchiveStatus<bool>(true);
             }
         }
-        return emptyBlocks;
+        if(!theArchive.arcFile.writeAt(reinterpret_cast<const char*>(&aHeader), sizeof(aHeader), getBlockOffset(arcPos))){
+            return ArchiveStatus<bool>(ArchiveErrors::fileWriteError);
+        }
+        return ArchiveStatus<bool>(true);
     }
 
     ArchiveStatus<Block> BlockHandler::writeToStream(Block &aBlock, size_t streamPos, std::fstream& anFStream, size_t arcPos, Archive& theArchive, StreamType theDestinationStreamType){
-        // when writing to archive, explicitly cast all metadata to string first. BlockFileName is already initialized with nulls
-        auto headerSize = sizeof(aBlock.header);
         if(theDestinationStreamType == StreamType::Archive) {
-            theArchive.arcFileStream.seekp(arcPos * kBlockSize);
-            theArchive.arcFileStream.write(reinterpret_cast<const char*>(&aBlock),sizeof(aBlock));
-            theArchive.arcFileStream.clear();
-        }
-        else {
-            // only write blockDataLen amount of data (i.e. don't write padding characters)
-            // and don't change pointer settings as this is variable length
-            auto theLoc = anFStream.tellp();
-            bool theRes = anFStream.fail();
-            anFStream.write((const char*) aBlock.data, aBlock.header.blockDataLen);
-            auto theCount = anFStream.gcount();
-            anFStream.clear();
+            return writeToStream(aBlock, arcPos, theArchive);
+        }
+        // only write blockDataLen amount of data (i.e. don't write padding characters)
+        // and don't change pointer settings as this is variable length
+        anFStream.write(aBlock.data.data(), aBlock.header.blockDataLen);
+        anFStream.clear();
+        return ArchiveStatus<Block>(aBlock);
+    }
+
+    ArchiveStatus<Block> BlockHandler::writeToStream(Block &aBlock, size_t arcPos, Archive& theArchive){
+        aBlock.data.resize(getPayloadSize());
+        aBlock.header.checksum = crc32c(aBlock.data.data(), std::min<size_t>(aBlock.header.blockDataLen, aBlock.data.size()));
+        struct iovec theVectors[2] = {
+                {&aBlock.header, headerSize},
+                {aBlock.data.data(), aBlock.data.size()}
+        };
+        if(!theArchive.arcFile.writeAt(theVectors, 2, getBlockOffset(arcPos))){
+            return ArchiveStatus<Block>(ArchiveErrors::fileWriteError);
         }
         return ArchiveStatus<Block>(aBlock);
     }
 
-    void TOC::addBlockMeta(std::string blockFileName, size_t theIndex){
-//        std::size_t pathHash = std::hash<std::string>{}(blockFileName);
-        // note, if multiple blocks per file, TOC map only stores index of first block; use block header to find next
-        mapTOC.insert(std::pair<std::string, size_t>(blockFileName, theIndex));
+    BlockSlab::BlockSlab(Archive &anArchive)
+        : archive(anArchive), maxSlabBlocks(std::max<size_t>(kSlabSize / anArchive.getBlockSize(), 1)), freeCount(0) {
+        slabBlocks = std::min(kFirstSlabBlocks, maxSlabBlocks);
+    }
+
+    BlockSlab::~BlockSlab(){
+        archive.releaseExtents(extents);
+    }
+
+    std::vector<Extent> BlockSlab::take(size_t aCount){
+        if(aCount >= maxSlabBlocks){ return archive.allocateExtents(aCount); }
+        if(freeCount < aCount){
+            while(slabBlocks < aCount){ slabBlocks = std::min(slabBlocks * 2, maxSlabBlocks); }
+            giveBack(archive.allocateExtents(slabBlocks));
+            slabBlocks = std::min(slabBlocks * 2, maxSlabBlocks);
+        }
+        std::vector<Extent> theTaken;
+        size_t i = 0;
+        for(; aCount; i++){
+            Extent theExtent{extents[i].start, std::min(extents[i].count, aCount)};
+            theTaken.push_back(theExtent);
+            aCount -= theExtent.count;
+            freeCount -= theExtent.count;
+            extents[i].start += theExtent.count;
+            extents[i].count -= theExtent.count;
+            if(extents[i].count){ break; }
+        }
+        extents.erase(extents.begin(), extents.begin() + i);
+        return theTaken;
+    }
+
+    void BlockSlab::giveBack(const std::vector<Extent> &anExtents){
+        for(auto& theExtent: anExtents){
+            if(!theExtent.count){ continue; }
+            auto theNext = std::lower_bound(extents.begin(), extents.end(), theExtent.start,
+                                            [](const Extent &anExtent, size_t aStart){ return anExtent.start < aStart; });
+            theNext = extents.insert(theNext, theExtent);
+            freeCount += theExtent.count;
+            if(theNext + 1 != extents.end() && theNext->getEnd() == (theNext + 1)->start){
+                theNext->count += (theNext + 1)->count;
+                extents.erase(theNext + 1);
+            }
+            if(theNext != extents.begin() && (theNext - 1)->getEnd() == theNext->start){
+                (theNext - 1)->count += theNext->count;
+                extents.erase(theNext);
+            }
+        }
+    }
+
+    BlockWriter::BlockWriter(Archive &anArchive, const Header &aTemplate, size_t anExpectedBlocks, BlockSlab* aSlab)
+        : archive(anArchive), slab(aSlab), blockTemplate(aTemplate), blockSize(anArchive.getBlockSize()), bufferStart(0),
+          bufferBlocks(0), maxBufferBlocks(std::max<size_t>(kWriteCombineSize / blockSize, 1)), fill(0),
+          reservedIndex(0), writes(std::make_unique<IOBatch>(anArchive.arcFile.getBackend())){
+        reserved = reserve(std::max<size_t>(anExpectedBlocks, 1));
+        buffer.reserve(std::min(reserved.empty() ? 1 : reserved.front().count, maxBufferBlocks) * blockSize);
+        startPending(takeNextPosition()); // can't fail, nothing is buffered yet
+    }
+
+    BlockWriter::BlockWriter(Archive &anArchive, const Header &aTemplate, const std::vector<Extent> &aReserved)
+        : archive(anArchive), slab(nullptr), blockTemplate(aTemplate), blockSize(anArchive.getBlockSize()),
+          bufferStart(0), bufferBlocks(0), maxBufferBlocks(std::max<size_t>(kWriteCombineSize / blockSize, 1)), fill(0),
+          reserved(aReserved), reservedIndex(0), writes(std::make_unique<IOBatch>(anArchive.arcFile.getBackend())){
+        buffer.reserve(std::min(reserved.empty() ? 1 : reserved.front().count, maxBufferBlocks) * blockSize);
+        startPending(takeNextPosition());
+    }
+
+    std::vector<Extent> BlockWriter::reserve(size_t aCount){
+        return slab ? slab->take(aCount) : archive.allocateExtents(aCount);
     }
 
-    size_t TOC::getBlockIndex(std::string blockFilePath){
-        return mapTOC[blockFilePath];
+    void BlockWriter::unreserve(const std::vector<Extent> &anExtents){
+        if(slab){ slab->giveBack(anExtents); }
+        else{ archive.releaseExtents(anExtents); }
+    }
+
+    size_t BlockWriter::takeNextPosition(){
+        if(reservedIndex == reserved.size()){
+            // the stream outgrew the estimate (e.g. data that doesn't compress), so reserve as much again as was written
+            reserved = reserve(std::max<size_t>(entry.getBlockCount(), 1));
+            reservedIndex = 0;
+        }
+        Extent &theExtent = reserved[reservedIndex];
+        size_t thePos = theExtent.start++;
+        if(!--theExtent.count){ reservedIndex++; }
+        return thePos;
+    }
+
+    ArchiveStatus<bool> BlockWriter::startPending(size_t aPos){
+        if(bufferBlocks && (aPos != bufferStart + bufferBlocks || bufferBlocks == maxBufferBlocks)){
+            auto theStatus = flushBuffer();
+            if(!theStatus.isOK()){ return theStatus; }
+        }
+        if(!bufferBlocks){ bufferStart = aPos; }
+        buffer.resize(std::max(buffer.size(), (bufferBlocks + 1) * blockSize));
+        pendingPos = aPos;
+        return ArchiveStatus<bool>(true);
+    }
+
+    ArchiveStatus<bool> BlockWriter::writePending(size_t aNextPos){
+        char* theBlock = buffer.data() + bufferBlocks * blockSize;
+        std::fill(theBlock + headerSize + fill, theBlock + blockSize, nullChar);
+        Header theHeader(blockTemplate);
+        theHeader.blockIndex = pendingPos;
+        theHeader.nextBlockIndex = aNextPos;
+        theHeader.blockDataLen = fill;
+        theHeader.checksum = crc32c(theBlock + headerSize, fill);
+        std::memcpy(theBlock, &theHeader, headerSize);
+        bufferBlocks++;
+        entry.addBlock(pendingPos);
+        entry.storedSize += fill;
+        fill = 0;
+        if(aNextPos == pendingPos){ return ArchiveStatus<bool>(true); } // the last block links to itself
+        return startPending(aNextPos);
+    }
+
+    ArchiveStatus<bool> BlockWriter::flushBuffer(){
+        if(!bufferBlocks){ return ArchiveStatus<bool>(true); }
+        // the spare buffer is taken over next, so its write has to be done
+        if(!writes->wait()){ return ArchiveStatus<bool>(ArchiveErrors::fileWriteError); }
+        archive.arcFile.writeAt(buffer.data(), bufferBlocks * blockSize,
+                                archive.arcBlockHandler.getBlockOffset(bufferStart), *writes);
+        std::swap(buffer, spareBuffer);
+        bufferBlocks = 0;
+        return ArchiveStatus<bool>(true);
+    }
+
+    ArchiveStatus<bool> BlockWriter::write(const char *aData, size_t aLength){
+        size_t thePayloadSize = blockSize - headerSize;
+        while(aLength){
+            // a full block is only completed once more data shows up, so the last block never ends up empty
+            if(fill == thePayloadSize){
+                auto theStatus = writePending(takeNextPosition());
+                if(!theStatus.isOK()){ return theStatus; }
+            }
+            size_t theChunk = std::min(aLength, thePayloadSize - fill);
+            std::memcpy(buffer.data() + bufferBlocks * blockSize + headerSize + fill, aData, theChunk);
+            fill += theChunk;
+            aData += theChunk;
+            aLength -= theChunk;
+        }
+        return ArchiveStatus<bool>(true);
+    }
+
+    ArchiveStatus<bool> BlockWriter::writeName(std::string_view aName){
+        LittleEndian<uint32_t> theLength(static_cast<uint32_t>(aName.size()));
+        auto theStatus = write(reinterpret_cast<const char*>(&theLength), kNameLengthSize);
+        if(theStatus.isOK()){ theStatus = write(aName.data(), aName.size()); }
+        entry.nameLength = static_cast<uint32_t>(aName.size());
+        return theStatus;
+    }
+
+    ArchiveStatus<TOCEntry> BlockWriter::finish(){
+        auto theStatus = writePending(pendingPos);
+        if(theStatus.isOK()){ theStatus = flushBuffer(); }
+        if(theStatus.isOK() && !writes->wait()){ theStatus = ArchiveStatus<bool>(ArchiveErrors::fileWriteError); }
+        if(!theStatus.isOK()){ return ArchiveStatus<TOCEntry>(theStatus.getError()); }
+        unreserve(std::vector<Extent>(reserved.begin() + reservedIndex, reserved.end()));
+        reserved.clear();
+        reservedIndex = 0;
+        entry.storedSize -= std::min<uint64_t>(entry.storedSize, entry.getNameRecordSize());
+        return ArchiveStatus<TOCEntry>(entry);
+    }
+
+    void BlockWriter::abort(){
+        std::vector<Extent> theExtents(entry.extents);
+        theExtents.push_back(Extent{pendingPos, 1});
+        theExtents.insert(theExtents.end(), reserved.begin() + reservedIndex, reserved.end());
+        writes->wait(); // queued blocks may still be on their way; they are given back along with the rest
+        unreserve(theExtents);
+        bufferBlocks = 0;
+        fill = 0;
+        entry = TOCEntry();
+        reserved.clear();
+        reservedIndex = 0;
+    }
+
+    ParallelDeflateStream::ParallelDeflateStream(size_t aThreadCount, size_t aChunkSize)
+        : threadCount(std::max<size_t>(aThreadCount, 1)), chunkSize(std::max<size_t>(aChunkSize, kDeflateWindowSize)),
+          checksum(adler32(0L, Z_NULL, 0)), hasHeader(false),
+          chunksPerSeekPoint(std::max<size_t>(kSeekPointInterval / chunkSize, 1)), chunksQueued(0), chunkCount(0),
+          rawOffset(0), storedOffset(0), isStopping(false) {}
+
+    ParallelDeflateStream::~ParallelDeflateStream(){
+        {
+            std::lock_guard<std::mutex> theLock(jobMutex);
+            isStopping = true;
+        }
+        jobQueued.notify_all();
+        for(auto& theWorker: workers){ theWorker.join(); }
+    }
+
+    ArchiveStatus<bool> ParallelDeflateStream::push(const char *aData, size_t aLength, bool isLast, std::string &anOutput){
+        if(!hasHeader){
+            // zlib header for a 32K window at the default level; the dictionaries are internal, so no FDICT
+            anOutput.push_back(static_cast<char>(0x78));
+            anOutput.push_back(static_cast<char>(0x9C));
+            storedOffset += 2;
+            hasHeader = true;
+        }
+        pending.append(aData, aLength);
+        size_t theDone = 0;
+        // the last chunk has to finish the stream, so a full chunk at the very end is left for it
+        while(pending.size() - theDone > chunkSize || (!isLast && pending.size() - theDone == chunkSize)){
+            queueChunk(pending.data() + theDone, chunkSize, false);
+            theDone += chunkSize;
+            auto theStatus = collect(anOutput, false);
+            if(!theStatus.isOK()){ return theStatus; }
+        }
+        if(isLast){
+            queueChunk(pending.data() + theDone, pending.size() - theDone, true);
+            theDone = pending.size();
+            auto theStatus = collect(anOutput, true);
+            if(!theStatus.isOK()){ return theStatus; }
+            for(int theShift=24; theShift>=0; theShift-=8){ anOutput.push_back(static_cast<char>(checksum >> theShift)); }
+        }
+        pending.erase(0, theDone);
+        return ArchiveStatus<bool>(true);
+    }
+
+    void ParallelDeflateStream::queueChunk(const char *aData, size_t aLength, bool isFinal){
+        auto theJob = std::make_unique<Job>();
+        // seek point chunks stand alone, so inflating can start right at them
+        bool isSeekPoint = chunksQueued++ % chunksPerSeekPoint == 0;
+        theJob->dictionaryLength = isSeekPoint ? 0 : history.size();
+        theJob->input.reserve(theJob->dictionaryLength + aLength);
+        theJob->input.append(history, history.size() - theJob->dictionaryLength, theJob->dictionaryLength);
+        theJob->input.append(aData, aLength);
+        theJob->rawLength = aLength;
+        theJob->isFinal = isFinal;
+        // the next chunk is primed with the tail of this one
+        if(aLength >= kDeflateWindowSize){ history.assign(aData + aLength - kDeflateWindowSize, kDeflateWindowSize); }
+        else{
+            history.append(aData, aLength);
+            if(history.size() > kDeflateWindowSize){ history.erase(0, history.size() - kDeflateWindowSize); }
+        }
+        // a stream that is a single chunk is deflated right here, without starting any worker
+        if(isFinal && workers.empty()){
+            deflateJob(*theJob);
+            theJob->isDone = true;
+            jobs.push_back(std::move(theJob));
+            return;
+        }
+        if(workers.empty()){
+            for(size_t i=0; i<threadCount; i++){ workers.emplace_back(&ParallelDeflateStream::runWorker, this); }
+        }
+        {
+            std::lock_guard<std::mutex> theLock(jobMutex);
+            queue.push_back(theJob.get());
+        }
+        jobs.push_back(std::move(theJob));
+        jobQueued.notify_one();
+    }
+
+    void ParallelDeflateStream::runWorker(){
+        std::unique_lock<std::mutex> theLock(jobMutex);
+        while(true){
+            jobQueued.wait(theLock, [this](){ return isStopping || !queue.empty(); });
+            if(isStopping){ return; }
+            Job* theJob = queue.front();
+            queue.pop_front();
+            theLock.unlock();
+            deflateJob(*theJob);
+            theLock.lock();
+            theJob->isDone = true;
+            jobDone.notify_all();
+        }
+    }
+
+    void ParallelDeflateStream::deflateJob(Job &aJob){
+        z_stream theStream{};
+        if(deflateInit2(&theStream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK){ return; }
+        if(aJob.dictionaryLength){
+            deflateSetDictionary(&theStream, reinterpret_cast<const Bytef*>(aJob.input.data()), aJob.dictionaryLength);
+        }
+        const char* theChunk = aJob.input.data() + aJob.dictionaryLength;
+        size_t theLength = aJob.input.size() - aJob.dictionaryLength;
+        theStream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(theChunk));
+        theStream.avail_in = theLength;
+        int ret;
+        do{
+            size_t theOldSize = aJob.output.size();
+            size_t theRoom = deflateBound(&theStream, theStream.avail_in) + 16; // room for the sync marker too
+            aJob.output.resize(theOldSize + theRoom);
+            theStream.next_out = reinterpret_cast<Bytef*>(&aJob.output[theOldSize]);
+            theStream.avail_out = theRoom;
+            ret = deflate(&theStream, aJob.isFinal ? Z_FINISH : Z_SYNC_FLUSH);
+            aJob.output.resize(theOldSize + theRoom - theStream.avail_out);
+        } while(ret == Z_OK && theStream.avail_out == 0);
+        aJob.isOK = ret != Z_STREAM_ERROR && (!aJob.isFinal || ret == Z_STREAM_END);
+        deflateEnd(&theStream);
+        aJob.checksum = adler32(adler32(0L, Z_NULL, 0), reinterpret_cast<const Bytef*>(theChunk), theLength);
+        aJob.input = std::string(); // the dictionary and input are not needed while the job waits its turn
+    }
+
+    ArchiveStatus<bool> ParallelDeflateStream::collect(std::string &anOutput, bool isWaiting){
+        while(!jobs.empty()){
+            Job &theJob = *jobs.front();
+            {
+                std::unique_lock<std::mutex> theLock(jobMutex);
+                if(!theJob.isDone){
+                    if(!isWaiting && jobs.size() < 2 * threadCount){ break; }
+                    jobDone.wait(theLock, [&theJob](){ return theJob.isDone; });
+                }
+            }
+            if(!theJob.isOK){ return ArchiveStatus<bool>(ArchiveErrors::badProcessor); }
+            if(chunkCount && chunkCount % chunksPerSeekPoint == 0 && theJob.rawLength){
+                seekPoints.push_back(SeekPoint{rawOffset, storedOffset});
+            }
+            anOutput += theJob.output;
+            checksum = adler32_combine(checksum, theJob.checksum, theJob.rawLength);
+            rawOffset += theJob.rawLength;
+            storedOffset += theJob.output.size();
+            chunkCount++;
+            jobs.pop_front();
+        }
+        return ArchiveStatus<bool>(true);
+    }
+
+    // gear table of the chunker; fixed values, since chunk boundaries (and so deduplication) must not change between runs
+    static const std::vector<uint64_t> kGearTable = [](){
+        std::vector<uint64_t> theTable(256);
+        uint64_t theState = 0x9E3779B97F4A7C15ull;
+        for(auto& theValue: theTable){ // splitmix64
+            uint64_t theMix = (theState += 0x9E3779B97F4A7C15ull);
+            theMix = (theMix ^ (theMix >> 30)) * 0xBF58476D1CE4E5B9ull;
+            theMix = (theMix ^ (theMix >> 27)) * 0x94D049BB133111EBull;
+            theValue = theMix ^ (theMix >> 31);
+        }
+        return theTable;
+    }();
+
+    ChunkingStream::ChunkingStream(Archive &anArchive) : archive(anArchive), rawOffset(0), storedOffset(0),
+                                                         nextSeekPoint(kSeekPointInterval) {}
+
+    size_t ChunkingStream::findBoundary(const char *aData, size_t aLength, bool isLast) const{
+        // the top kChunkMaskBits bits of the gear hash depend on the last 64 bytes, which makes them the cut condition
+        uint64_t theHash = 0;
+        size_t theLimit = std::min(aLength, kMaxChunkSize);
+        for(size_t i=kMinChunkSize; i<theLimit; i++){
+            theHash = (theHash << 1) + kGearTable[static_cast<uint8_t>(aData[i])];
+            if(!(theHash >> (64 - kChunkMaskBits))){ return i + 1; }
+        }
+        if(aLength >= kMaxChunkSize){ return kMaxChunkSize; }
+        return isLast ? aLength : 0;
+    }
+
+    ArchiveStatus<bool> ChunkingStream::push(const char *aData, size_t aLength, bool isLast, std::string &anOutput){
+        pending.append(aData, aLength);
+        size_t theStart = 0;
+        while(theStart < pending.size()){
+            size_t theLength = findBoundary(pending.data() + theStart, pending.size() - theStart, isLast);
+            if(!theLength){ break; }
+            if(rawOffset >= nextSeekPoint){
+                seekPoints.push_back(SeekPoint{rawOffset, storedOffset});
+                nextSeekPoint = rawOffset + kSeekPointInterval;
+            }
+            auto theDigest = archive.storeChunk(pending.data() + theStart, theLength);
+            if(!theDigest.isOK()){ return ArchiveStatus<bool>(theDigest.getError()); }
+            references.push_back(theDigest.getValue());
+            anOutput += references.back();
+            appendValue(anOutput, static_cast<uint32_t>(theLength));
+            rawOffset += theLength;
+            storedOffset += kRecipeRecordSize;
+            theStart += theLength;
+        }
+        pending.erase(0, theStart);
+        return ArchiveStatus<bool>(true);
+    }
+
+    void ChunkingStream::abort(){
+        for(auto& theDigest: references){ archive.releaseChunk(theDigest); }
+        references.clear();
+    }
+
+    ArchiveStatus<bool> RecipeStream::push(const char *aData, size_t aLength, bool isLast, std::string &anOutput){
+        pending.append(aData, aLength);
+        size_t thePos = 0;
+        for(; pending.size() - thePos >= kRecipeRecordSize; thePos += kRecipeRecordSize){
+            uint32_t theLength;
+            size_t theLengthPos = thePos + kSha256Size;
+            readValue(pending, theLengthPos, theLength);
+            const ChunkEntry* theChunk = archive.arcChunks.getEntry(pending.substr(thePos, kSha256Size));
+            if(!theChunk || theChunk->blocks.storedSize != theLength){ return ArchiveStatus<bool>(ArchiveErrors::badData); }
+            auto theStatus = archive.visitStored(theChunk->blocks, 0, [&anOutput](const char* aChunkData, size_t aSize){
+                anOutput.append(aChunkData, aSize);
+                return true;
+            });
+            if(!theStatus.isOK()){ return theStatus; }
+        }
+        pending.erase(0, thePos);
+        if(isLast && !pending.empty()){ return ArchiveStatus<bool>(ArchiveErrors::badData); } // torn record
+        return ArchiveStatus<bool>(true);
+    }
+
+    size_t TOCEntry::getBlockCount() const{
+        size_t theCount = 0;
+        for(auto& theExtent: extents){ theCount += theExtent.count; }
+        return theCount;
+    }
+
+    void TOCEntry::addBlock(size_t aBlockIndex){
+        if(!extents.empty() && extents.back().getEnd() == aBlockIndex){ extents.back().count++; }
+        else{ extents.push_back(Extent{aBlockIndex, 1}); }
+    }
+
+    size_t TOC::findSlot(std::string_view aName, size_t aHash) const{
+        size_t theMask = slots.size() - 1;
+        for(size_t i = aHash & theMask;; i = (i + 1) & theMask){
+            uint32_t theIndex = slots[i];
+            if(theIndex == kEmptySlot || (names[theIndex].hash == aHash && getName(theIndex) == aName)){ return i; }
+        }
+    }
+
+    size_t TOC::findSlotOf(size_t anIndex) const{
+        size_t theMask = slots.size() - 1;
+        size_t i = names[anIndex].hash & theMask;
+        while(slots[i] != anIndex){ i = (i + 1) & theMask; }
+        return i;
+    }
+
+    void TOC::rehash(size_t aSlotCount){
+        slots.assign(aSlotCount, kEmptySlot);
+        size_t theMask = aSlotCount - 1;
+        for(size_t theIndex=0; theIndex<entries.size(); theIndex++){
+            size_t i = names[theIndex].hash & theMask;
+            while(slots[i] != kEmptySlot){ i = (i + 1) & theMask; }
+            slots[i] = static_cast<uint32_t>(theIndex);
+        }
+    }
+
+    void TOC::reserve(size_t aCount){
+        size_t theSlotCount = std::max<size_t>(slots.size(), 16);
+        while(aCount * 4 > theSlotCount * 3){ theSlotCount *= 2; }
+        if(theSlotCount != slots.size()){ rehash(theSlotCount); }
+        entries.reserve(aCount);
+        names.reserve(aCount);
+    }
+
+    bool TOC::addEntry(std::string_view aName, const TOCEntry &anEntry){
+        size_t theHash = std::hash<std::string_view>()(aName);
+        if(entries.size() == entries.capacity()){ reserve(std::max<size_t>(entries.size() * 2, 16)); }
+        else{ reserve(entries.size() + 1); }
+        size_t theSlot = findSlot(aName, theHash);
+        if(slots[theSlot] != kEmptySlot){ return false; }
+        slots[theSlot] = static_cast<uint32_t>(entries.size());
+        names.push_back(Name{arena.size(), aName.size(), theHash});
+        arena.append(aName);
+        entries.push_back(anEntry);
+        if(!isSortedStale && ++sortedPatches > kSortedPatchLimit){ isSortedStale = true; }
+        if(!isSortedStale){
+            sorted.insert(sorted.begin() + findSorted(aName), static_cast<uint32_t>(entries.size() - 1));
+        }
+        return true;
+    }
+
+    const TOCEntry* TOC::getEntry(std::string_view aName) const{
+        if(entries.empty()){ return nullptr; }
+        uint32_t theIndex = slots[findSlot(aName, std::hash<std::string_view>()(aName))];
+        return theIndex == kEmptySlot ? nullptr : &entries[theIndex];
+    }
+
+    TOCEntry* TOC::getEntry(std::string_view aName){
+        return const_cast<TOCEntry*>(static_cast<const TOC*>(this)->getEntry(aName));
+    }
+
+    bool TOC::removeEntry(std::string_view aName){
+        if(entries.empty()){ return false; }
+        size_t theHole = findSlot(aName, std::hash<std::string_view>()(aName));
+        uint32_t theIndex = slots[theHole];
+        if(theIndex == kEmptySlot){ return false; }
+        // backward-shift deletion: later entries of the probe run move up into the hole unless that would put them
+        // before their home slot, so runs stay unbroken without tombstones
+        size_t theMask = slots.size() - 1;
+        for(size_t i = (theHole + 1) & theMask; slots[i] != kEmptySlot; i = (i + 1) & theMask){
+            size_t theHome = names[slots[i]].hash & theMask;
+            bool isHomeInRun = theHole <= i ? (theHome > theHole && theHome <= i) : (theHome > theHole || theHome <= i);
+            if(!isHomeInRun){
+                slots[theHole] = slots[i];
+                theHole = i;
+            }
+        }
+        slots[theHole] = kEmptySlot;
+        size_t theLast = entries.size() - 1;
+        if(!isSortedStale && ++sortedPatches > kSortedPatchLimit){ isSortedStale = true; }
+        if(!isSortedStale){
+            sorted.erase(sorted.begin() + findSorted(aName));
+            if(theIndex != theLast){ sorted[findSorted(getName(theLast))] = theIndex; }
+        }
+        // the last entry fills the gap in the dense arrays
+        arenaGarbage += names[theIndex].length;
+        if(theIndex != theLast){
+            slots[findSlotOf(theLast)] = theIndex;
+            entries[theIndex] = std::move(entries[theLast]);
+            names[theIndex] = names[theLast];
+        }
+        entries.pop_back();
+        names.pop_back();
+        // the arena is rewritten once removed names make up half of it
+        if(arenaGarbage * 2 > arena.size()){
+            std::string theArena;
+            theArena.reserve(arena.size() - arenaGarbage);
+            for(auto& theName: names){
+                theArena.append(arena, theName.offset, theName.length);
+                theName.offset = theArena.size() - theName.length;
+            }
+            arena.swap(theArena);
+            arenaGarbage = 0;
+        }
+        return true;
+    }
+
+    void TOC::clear(){
+        entries.clear();
+        names.clear();
+        arena.clear();
+        arenaGarbage = 0;
+        slots.clear();
+        sorted.clear();
+        isSortedStale = false;
+        sortedPatches = 0;
+    }
+
+    size_t TOC::findSorted(std::string_view aName) const{
+        return std::lower_bound(sorted.begin(), sorted.end(), aName, [this](uint32_t anIndex, std::string_view aKey){
+            return getName(anIndex) < aKey;
+        }) - sorted.begin();
+    }
+
+    std::pair<size_t, size_t> TOC::findPrefix(std::string_view aPrefix) const{
+        if(isSortedStale){
+            sorted.resize(entries.size());
+            for(size_t i=0; i<sorted.size(); i++){ sorted[i] = static_cast<uint32_t>(i); }
+            std::sort(sorted.begin(), sorted.end(), [this](uint32_t aFirst, uint32_t aSecond){
+                return getName(aFirst) < getName(aSecond);
+            });
+            isSortedStale = false;
+        }
+        sortedPatches = 0;
+        // names with the prefix form one run in name order, starting at the first name not below the prefix
+        auto theFirst = sorted.begin() + findSorted(aPrefix);
+        auto theLast = std::partition_point(theFirst, sorted.end(), [this, aPrefix](uint32_t anIndex){
+            return getName(anIndex).substr(0, aPrefix.size()) == aPrefix;
+        });
+        return {static_cast<size_t>(theFirst - sorted.begin()), static_cast<size_t>(theLast - sorted.begin())};
+    }
+
+    void TOCEntry::serialize(std::string &anOutput) const{
+        // layout: the stored size, the extent list and the seek point list
+        appendValue(anOutput, storedSize);
+        appendValue(anOutput, static_cast<uint32_t>(extents.size()));
+        appendValues<uint64_t>(anOutput, extents.data(), extents.size());
+        appendValue(anOutput, static_cast<uint32_t>(seekPoints.size()));
+        appendValues<uint64_t>(anOutput, seekPoints.data(), seekPoints.size());
+    }
+
+    bool TOCEntry::deserialize(const std::string &anInput, size_t &aPos){
+        uint32_t theExtentCount;
+        if(!readValue(anInput, aPos, storedSize) || !readValue(anInput, aPos, theExtentCount) ||
+           aPos + theExtentCount * sizeof(Extent) > anInput.size()){
+            return false;
+        }
+        extents.resize(theExtentCount);
+        uint32_t thePointCount;
+        if(!readValues<uint64_t>(anInput, aPos, extents.data(), theExtentCount) ||
+           !readValue(anInput, aPos, thePointCount) || aPos + thePointCount * sizeof(SeekPoint) > anInput.size()){
+            return false;
+        }
+        seekPoints.resize(thePointCount);
+        return readValues<uint64_t>(anInput, aPos, seekPoints.data(), thePointCount);
+    }
+
+    void TOC::serialize(std::string &anOutput) const{
+        // layout: entry count, then per entry the name length, the name bytes and the entry itself
+        appendValue(anOutput, static_cast<uint64_t>(entries.size()));
+        for(size_t i=0; i<entries.size(); i++){
+            appendValue(anOutput, static_cast<uint32_t>(names[i].length));
+            anOutput.append(getName(i));
+            entries[i].serialize(anOutput);
+        }
+    }
+
+    bool TOC::deserialize(const std::string &anInput, size_t &aPos){
+        clear();
+        uint64_t theCount;
+        if(!readValue(anInput, aPos, theCount) || theCount > anInput.size() - aPos){ return false; }
+        // the table is sized once for the whole index instead of growing entry by entry, and sorted by the first lookup
+        reserve(theCount);
+        isSortedStale = true;
+        for(uint64_t i=0; i<theCount; i++){
+            uint32_t theNameLen;
+            if(!readValue(anInput, aPos, theNameLen) || aPos + theNameLen > anInput.size()){ return false; }
+            std::string_view theName(anInput.data() + aPos, theNameLen);
+            aPos += theNameLen;
+            TOCEntry theEntry;
+            if(!theEntry.deserialize(anInput, aPos)){ return false; }
+            theEntry.nameLength = theNameLen;
+            addEntry(theName, theEntry);
+        }
+        return true;
+    }
+
+    ChunkEntry* ChunkIndex::getEntry(const std::string &aDigest){
+        auto theChunk = mapChunks.find(aDigest);
+        return theChunk == mapChunks.end() ? nullptr : &theChunk->second;
+    }
+
+    void ChunkIndex::serialize(std::string &anOutput) const{
+        // layout: chunk count, then per chunk the digest, the reference count and the entry
+        appendValue(anOutput, static_cast<uint64_t>(mapChunks.size()));
+        for(auto& [theDigest, theChunk]: mapChunks){
+            anOutput.append(theDigest);
+            appendValue(anOutput, theChunk.refCount);
+            theChunk.blocks.serialize(anOutput);
+        }
+    }
+
+    bool ChunkIndex::deserialize(const std::string &anInput, size_t &aPos){
+        mapChunks.clear();
+        uint64_t theCount;
+        if(!readValue(anInput, aPos, theCount)){ return false; }
+        for(uint64_t i=0; i<theCount; i++){
+            if(aPos + kSha256Size > anInput.size()){ return false; }
+            std::string theDigest(anInput.data() + aPos, kSha256Size);
+            aPos += kSha256Size;
+            ChunkEntry theChunk;
+            if(!readValue(anInput, aPos, theChunk.refCount) || !theChunk.blocks.deserialize(anInput, aPos)){ return false; }
+            mapChunks.emplace(theDigest, theChunk);
+        }
+        return true;
+    }
+
+    FreeSpaceMap::FreeSpaceMap() : numBlocks(0), freeCount(0) {}
+
+    void FreeSpaceMap::reset(size_t aNumBlocks){
+        bitmap.clear();
+        runs.clear();
+        runsByLength.clear();
+        numBlocks = 0;
+        freeCount = 0;
+        resize(aNumBlocks);
+    }
+
+    void FreeSpaceMap::resize(size_t aNumBlocks){
+        if(aNumBlocks > numBlocks){
+            bitmap.resize((aNumBlocks + 63) / 64, 0);
+            numBlocks = aNumBlocks;
+        }
+    }
+
+    std::optional<size_t> FreeSpaceMap::findRun(size_t aCount) const{
+        if(!aCount || freeCount < aCount){ return std::nullopt; }
+        auto theRun = runsByLength.lower_bound({aCount, 0});
+        if(theRun == runsByLength.end()){ return std::nullopt; }
+        return theRun->second;
+    }
+
+    Extent FreeSpaceMap::allocateRun(size_t aMaxCount){
+        if(runs.empty() || !aMaxCount){ return Extent{numBlocks, 0}; }
+        Extent theExtent{runs.begin()->first, std::min(runs.begin()->second, aMaxCount)};
+        claim(theExtent);
+        return theExtent;
+    }
+
+    void FreeSpaceMap::claim(const Extent &anExtent){
+        if(!anExtent.count || !setBits(anExtent.start, anExtent.getEnd(), false)){ return; }
+        // the runs overlapping the extent lose that part; what is left of them on either side stays free
+        auto theRun = runs.upper_bound(anExtent.start);
+        if(theRun != runs.begin() && std::prev(theRun)->first + std::prev(theRun)->second > anExtent.start){ --theRun; }
+        while(theRun != runs.end() && theRun->first < anExtent.getEnd()){
+            size_t theStart = theRun->first;
+            size_t theEnd = theStart + theRun->second;
+            eraseRun(theRun++);
+            if(theStart < anExtent.start){ addRun(theStart, anExtent.start - theStart); }
+            if(theEnd > anExtent.getEnd()){ addRun(anExtent.getEnd(), theEnd - anExtent.getEnd()); }
+        }
+    }
+
+    void FreeSpaceMap::release(size_t aBlockIndex){
+        release(Extent{aBlockIndex, 1});
+    }
+
+    void FreeSpaceMap::release(const Extent &anExtent){
+        if(!anExtent.count){ return; }
+        resize(anExtent.getEnd());
+        if(!setBits(anExtent.start, anExtent.getEnd(), true)){ return; }
+        // merge with the runs it overlaps or touches, so runs stay maximal
+        size_t theStart = anExtent.start;
+        size_t theEnd = anExtent.getEnd();
+        auto theRun = runs.upper_bound(theStart);
+        if(theRun != runs.begin() && std::prev(theRun)->first + std::prev(theRun)->second >= theStart){ --theRun; }
+        while(theRun != runs.end() && theRun->first <= theEnd){
+            theStart = std::min(theStart, theRun->first);
+            theEnd = std::max(theEnd, theRun->first + theRun->second);
+            eraseRun(theRun++);
+        }
+        addRun(theStart, theEnd - theStart);
+    }
+
+    void FreeSpaceMap::truncate(size_t aNumBlocks){
+        if(aNumBlocks >= numBlocks){ return; }
+        claim(Extent{aNumBlocks, numBlocks - aNumBlocks});
+        numBlocks = aNumBlocks;
+        bitmap.resize((aNumBlocks + 63) / 64);
+    }
+
+    size_t FreeSpaceMap::setBits(size_t aStart, size_t anEnd, bool isFree){
+        size_t theChanged = 0;
+        while(aStart < anEnd){
+            size_t theBit = aStart % 64;
+            size_t theCount = std::min<size_t>(64 - theBit, anEnd - aStart);
+            uint64_t theMask = (theCount == 64 ? ~uint64_t(0) : (uint64_t(1) << theCount) - 1) << theBit;
+            auto &theWord = bitmap[aStart / 64];
+            uint64_t theFlipped = (isFree ? ~theWord : theWord) & theMask;
+            theChanged += __builtin_popcountll(theFlipped);
+            theWord ^= theFlipped;
+            aStart += theCount;
+        }
+        freeCount = isFree ? freeCount + theChanged : freeCount - theChanged;
+        return theChanged;
+    }
+
+    void FreeSpaceMap::addRun(size_t aStart, size_t aLength){
+        runs.emplace(aStart, aLength);
+        runsByLength.emplace(aLength, aStart);
+    }
+
+    void FreeSpaceMap::eraseRun(std::map<size_t, size_t>::iterator aRun){
+        runsByLength.erase({aRun->second, aRun->first});
+        runs.erase(aRun);
+    }
+
+    bool FreeSpaceMap::isFree(size_t aBlockIndex) const{
+        if(aBlockIndex >= numBlocks){ return false; }
+        return (bitmap[aBlockIndex / 64] >> (aBlockIndex % 64)) & 1;
+    }
+
+    void FreeSpaceMap::serialize(std::string &anOutput) const{
+        // layout: number of blocks covered, then the raw bitmap words
+        appendValue(anOutput, static_cast<uint64_t>(numBlocks));
+        appendValues<uint64_t>(anOutput, bitmap.data(), bitmap.size());
+    }
+
+    bool FreeSpaceMap::deserialize(const std::string &anInput, size_t &aPos){
+        uint64_t theNumBlocks;
+        if(!readValue(anInput, aPos, theNumBlocks)){ return false; }
+        reset(theNumBlocks);
+        if(!readValues<uint64_t>(anInput, aPos, bitmap.data(), bitmap.size())){ return false; }
+        if(theNumBlocks % 64 && (bitmap.back() >> (theNumBlocks % 64))){ return false; }
+        // collect the runs word by word, skipping over all-used and all-free words whole
+        size_t theRunStart = 0;
+        size_t theRunLength = 0;
+        for(size_t theWord=0; theWord<bitmap.size(); theWord++){
+            uint64_t theBits = bitmap[theWord];
+            freeCount += __builtin_popcountll(theBits);
+            size_t theBit = 0;
+            while(theBit < 64){
+                uint64_t theRest = theBits >> theBit;
+                if(!theRest){
+                    if(theRunLength){ addRun(theRunStart, theRunLength); }
+                    theRunLength = 0;
+                    break;
+                }
+                size_t theUsed = __builtin_ctzll(theRest);
+                if(theUsed){
+                    if(theRunLength){ addRun(theRunStart, theRunLength); }
+                    theRunLength = 0;
+                    theBit += theUsed;
+                    theRest >>= theUsed;
+                }
+                size_t theFree = ~theRest ? __builtin_ctzll(~theRest) : 64 - theBit;
+                if(!theRunLength){ theRunStart = theWord * 64 + theBit; }
+                theRunLength += theFree;
+                theBit += theFree;
+            }
+        }
+        if(theRunLength){ addRun(theRunStart, theRunLength); }
+        return true;
+    }
+
+    ArchiveStatus<TOCEntry> Archive::packFile(const std::string &aFilename, IDataProcessor* aProcessor,
+                                              const Extent &aReserved, BlockSlab* aSlab){
+        std::ifstream theStream(aFilename, std::ios::binary | std::ios::ate);
+        if(!theStream){ return ArchiveStatus<TOCEntry>(ArchiveErrors::fileOpenError); }
+        size_t theFileSize = theStream.tellg();
+        theStream.seekg(0);
+
+        // every block of the file carries its name id and, if it was processed, the processor that extract has to undo
+        Header theTemplate;
+        theTemplate.nameId = arcNextNameId++;
+        std::unique_ptr<IDataStream> theTransform;
+        if(aProcessor){
+            theTemplate.isProcessed = true;
+            std::strncpy(theTemplate.processorType, aProcessor->getTypeName(), kProcessorTypeNameSize - 1);
+            theTransform = aProcessor->makeProcessStream();
+        }
+
+        // processed output that comes out smaller than the estimate hands its spare blocks back
+        size_t theExpectedSize = kNameLengthSize + aFilename.size() + (aProcessor ? aProcessor->estimateStoredSize(theFileSize) : theFileSize);
+        std::unique_ptr<BlockWriter> theWriterPtr;
+        if(aReserved.count){ theWriterPtr = std::make_unique<BlockWriter>(*this, theTemplate, std::vector<Extent>{aReserved}); }
+        else{
+            theWriterPtr = std::make_unique<BlockWriter>(*this, theTemplate,
+                                                         theExpectedSize / arcBlockHandler.getPayloadSize() + 1, aSlab);
+        }
+        BlockWriter &theWriter = *theWriterPtr;
+        std::vector<char> theChunk(kStreamChunkSize);
+        std::string theOutput;
+        bool isLast = false;
+        ArchiveErrors theError = theWriter.writeName(aFilename).getError();
+        while(!isLast && theError == ArchiveErrors::noError){
+            theStream.read(theChunk.data(), theChunk.size());
+            size_t theCount = theStream.gcount();
+            if(theStream.bad()){ theError = ArchiveErrors::fileReadError; break; }
+            isLast = theStream.eof() || !theCount;
+            const char* theData = theChunk.data();
+            if(theTransform){
+                theOutput.clear();
+                auto theStatus = theTransform->push(theChunk.data(), theCount, isLast, theOutput);
+                if(!theStatus.isOK()){ theError = theStatus.getError(); break; }
+                theData = theOutput.data();
+                theCount = theOutput.size();
+            }
+            auto theStatus = theWriter.write(theData, theCount);
+            if(!theStatus.isOK()){ theError = theStatus.getError(); }
+        }
+        if(theError == ArchiveErrors::noError){
+            auto theStatus = theWriter.finish();
+            if(theStatus.isOK()){
+                TOCEntry theEntry = theStatus.getValue();
+                if(theTransform){ theEntry.seekPoints = theTransform->getSeekPoints(); }
+                return ArchiveStatus<TOCEntry>(theEntry);
+            }
+            theError = theStatus.getError();
+        }
+        theWriter.abort();
+        if(theTransform){ theTransform->abort(); }
+        return ArchiveStatus<TOCEntry>(theError);
     }
 
     ArchiveStatus<bool> Archive::add(const std::string &aFilename, IDataProcessor* aProcessor){
+        std::lock_guard<std::recursive_mutex> theLock(arcOperationMutex);
         // check that a file with the same name doesn't already exist
-        if(arcTOC.mapTOC.find(aFilename) != arcTOC.mapTOC.end()) {
+        if(arcTOC.getEntry(aFilename)) {
             return ArchiveStatus<bool>(ArchiveErrors::fileExists);
         }
-        auto theFileMode = std::fstream::binary |
-                             std::fstream::in | std::fstream::out;
-        std::fstream theStream;
-        theStream.open(aFilename, theFileMode);
-        theStream.seekp(0);
+        markDirty();
+        auto theStatus = packFile(aFilename, aProcessor);
+        if(!theStatus.isOK()){
+            notifyObservers(ActionType::added, aFilename, false);
+            return ArchiveStatus<bool>(theStatus.getError());
+        }
+        arcTOC.addEntry(aFilename, theStatus.getValue());
+        notifyObservers(ActionType::added, aFilename, true);
+        return ArchiveStatus<bool>(true);
+    }
+
+    ArchiveStatus<size_t> Archive::addMany(const std::vector<std::string> &aPaths, IDataProcessor* aProcessor,
+                                           size_t aThreadCount){
+        std::lock_guard<std::recursive_mutex> theLock(arcOperationMutex);
+        // names already in the archive or repeated within the batch are turned away before any worker starts
+        std::vector<std::string> theNames;
+        std::set<std::string> theSeen;
+        for(auto& thePath: aPaths){
+            if(arcTOC.getEntry(thePath) || !theSeen.insert(thePath).second){
+                notifyObservers(ActionType::added, thePath, false);
+                continue;
+            }
+            theNames.push_back(thePath);
+        }
+        if(theNames.empty()){ return ArchiveStatus<size_t>(0); }
+        markDirty();
 
-        // --------------- Processing  ----------------
+        // unprocessed files get exact slices of one region reserved up front; processed ones come from per-worker slabs
+        std::vector<Extent> theSlices;
+        if(!aProcessor){
+            std::vector<size_t> theSizes;
+            for(auto& theName: theNames){
+                std::error_code theError;
+                size_t theSize = std::filesystem::file_size(theName, theError);
+                theSizes.push_back(theError ? 0 : theSize);
+            }
+            theSlices = appendSlices(theNames, theSizes);
+        }
+        auto theEntries = packBatch(theNames, aProcessor, aThreadCount, theSlices);
 
-        // processing opens the input file to compress and saves processed result to temp output file, which getAsBlock will read in below
-        if(aProcessor){
-            aProcessor->process(aFilename);
-            // now update the stream to be the processed file rather than the original input file
-            theStream.close();
-            std::string destFilePath{aFilename};
-            destFilePath.insert(aFilename.length()-4,"_processed");
-            theStream.open(destFilePath, theFileMode);
-            // NOTE: the blocks metadata for isProcessed is updated below just before getAsBlock
-        }
-        // ---------------- End processing  ------------
-
-        size_t numBlocksNeeded = getStreamNumBlocks(theStream, StreamType::NonArchive);
-
-        // get the empty blocks first
-        std::vector<Block> emptyBlocks = arcBlockHandler.getEmptyBlocks(*this);
-
-        for(size_t i=0; i<numBlocksNeeded; i++){
-            // initialize as empty block to append at end of archive, overwrite if empty blocks exist
-            Block theBlock;
-            size_t thePos{arcNumBlocks};
-            theBlock.header.blockIndex = thePos;
-            if(i < numBlocksNeeded - 1){ theBlock.header.nextBlockIndex = thePos + 1; }
-            else{ theBlock.header.nextBlockIndex = thePos; }
-            arcNumBlocks++;
-
-            std::strcpy(theBlock.header.blockFileName, aFilename.c_str()); // whether its empty or new block, the filename should be explicitly set
-
-            // ----------------- Processing ----------------------
-            if(aProcessor) {
-                theBlock.header.isProcessed = true;
-                // figure out which processor was called and enter the name into header.processorType
-                if(typeid(*aProcessor) == typeid(Compression)){
-                    std::strcpy(theBlock.header.processorType, "comp");
+        // the TOC and the observers are only touched here, on the calling thread, in the order of aPaths
+        size_t theCount = 0;
+        for(size_t i=0; i<theNames.size(); i++){
+            if(theEntries[i].isOK()){
+                arcTOC.addEntry(theNames[i], theEntries[i].getValue());
+                theCount++;
+            }
+            notifyObservers(ActionType::added, theNames[i], theEntries[i].isOK());
+        }
+        return ArchiveStatus<size_t>(theCount);
+    }
+
+    std::vector<ArchiveStatus<TOCEntry>> Archive::packBatch(const std::vector<std::string> &aNames,
+                                                            IDataProcessor* aProcessor, size_t aThreadCount,
+                                                            const std::vector<Extent> &aReserved){
+        std::vector<ArchiveStatus<TOCEntry>> theEntries;
+        for(size_t i=0; i<aNames.size(); i++){ theEntries.emplace_back(ArchiveErrors::fileOpenError); }
+        if(aNames.empty()){ return theEntries; }
+        if(!aThreadCount){ aThreadCount = std::max(1u, std::thread::hardware_concurrency()); }
+        aThreadCount = std::min(aThreadCount, aNames.size());
+        std::atomic<size_t> theNextName{0};
+        auto packFiles = [&](){
+            BlockSlab theSlab(*this);
+            for(size_t i; (i = theNextName++) < aNames.size();){
+                theEntries[i] = packFile(aNames[i], aProcessor, aReserved.empty() ? Extent{0, 0} : aReserved[i], &theSlab);
+            }
+        };
+        std::vector<std::thread> theWorkers;
+        for(size_t i=1; i<aThreadCount; i++){ theWorkers.emplace_back(packFiles); }
+        packFiles(); // the calling thread takes a share as well
+        for(auto& theWorker: theWorkers){ theWorker.join(); }
+        return theEntries;
+    }
+
+    Extent Archive::appendExtent(size_t aCount){
+        std::lock_guard<std::mutex> theLock(arcAllocationMutex);
+        Extent theExtent{arcNumBlocks, aCount};
+        arcNumBlocks += aCount;
+        arcFreeSpace.resize(arcNumBlocks);
+        return theExtent;
+    }
+
+    std::vector<Extent> Archive::appendSlices(const std::vector<std::string> &aNames, const std::vector<size_t> &aFileSizes){
+        size_t thePayloadSize = arcBlockHandler.getPayloadSize();
+        std::vector<size_t> theBlockCounts;
+        size_t theTotalBlocks = 0;
+        for(size_t i=0; i<aNames.size(); i++){
+            // the stream starts with the name length and the name
+            size_t theStreamSize = kNameLengthSize + aNames[i].size() + aFileSizes[i];
+            theBlockCounts.push_back(std::max<size_t>((theStreamSize + thePayloadSize - 1) / thePayloadSize, 1));
+            theTotalBlocks += theBlockCounts.back();
+        }
+        Extent theRegion = appendExtent(theTotalBlocks);
+        std::vector<Extent> theSlices;
+        for(auto theCount: theBlockCounts){
+            theSlices.push_back(Extent{theRegion.start, theCount});
+            theRegion.start += theCount;
+        }
+        return theSlices;
+    }
+
+    ArchiveStatus<bool> Archive::addFolder(const std::string &aFolder, IDataProcessor* aProcessor, size_t aThreadCount){
+        std::lock_guard<std::recursive_mutex> theLock(arcOperationMutex);
+        std::error_code theError;
+        if(!std::filesystem::is_directory(aFolder, theError)){ return ArchiveStatus<bool>(ArchiveErrors::badPath); }
+        if(!aThreadCount){ aThreadCount = std::max(1u, std::thread::hardware_concurrency()); }
+
+        // the workers share a queue of folders: each lists one folder at a time and queues the folders it finds there
+        struct FoundFile{
+            std::filesystem::path path;
+            size_t size;
+        };
+        std::vector<FoundFile> theFiles;
+        std::vector<std::filesystem::path> theFolders{aFolder};
+        size_t theBusyCount = 0;
+        std::mutex theWalkMutex;
+        std::condition_variable theWalkSignal;
+        auto walk = [&](){
+            std::unique_lock<std::mutex> theWalkLock(theWalkMutex);
+            for(;;){
+                theWalkSignal.wait(theWalkLock, [&](){ return !theFolders.empty() || !theBusyCount; });
+                if(theFolders.empty()){ return; }
+                std::filesystem::path theFolder = theFolders.back();
+                theFolders.pop_back();
+                theBusyCount++;
+                theWalkLock.unlock();
+                std::vector<FoundFile> theFound;
+                std::vector<std::filesystem::path> theSubfolders;
+                std::error_code theListError;
+                for(std::filesystem::directory_iterator it(theFolder, theListError), theEnd;
+                    !theListError && it != theEnd; it.increment(theListError)){
+                    std::error_code theEntryError;
+                    if(it->is_symlink(theEntryError)){ continue; }
+                    if(it->is_directory(theEntryError)){ theSubfolders.push_back(it->path()); }
+                    else if(it->is_regular_file(theEntryError)){ theFound.push_back({it->path(), it->file_size(theEntryError)}); }
                 }
+                theWalkLock.lock();
+                theFiles.insert(theFiles.end(), theFound.begin(), theFound.end());
+                theFolders.insert(theFolders.end(), theSubfolders.begin(), theSubfolders.end());
+                theBusyCount--;
+                theWalkSignal.notify_all();
             }
-            auto theStatus = arcBlockHandler.getAsBlock(theBlock, i, theStream, thePos, *this,
-                                                        StreamType::NonArchive);
+        };
+        {
+            std::vector<std::thread> theWalkers;
+            for(size_t i=1; i<aThreadCount; i++){ theWalkers.emplace_back(walk); }
+            walk();
+            for(auto& theWalker: theWalkers){ theWalker.join(); }
+        }
 
-            // blockDataLen is updated inside getAsBlock so when writing to stream, we only write that much data
-            theStatus.getValue(); // does error checking
-            auto theWriteStatus = arcBlockHandler.writeToStream(theBlock, i,theStream,
-                                                                thePos, *this, StreamType::Archive);
-            if(!theWriteStatus.isOK()){
-                notifyObservers(ActionType::added, aFilename, false);
-                return ArchiveStatus<bool>(false);
+        // files of one folder and one type end up next to each other
+        std::sort(theFiles.begin(), theFiles.end(), [](const FoundFile &aFirst, const FoundFile &aSecond){
+            return std::make_tuple(aFirst.path.parent_path(), aFirst.path.extension(), aFirst.path.filename()) <
+                   std::make_tuple(aSecond.path.parent_path(), aSecond.path.extension(), aSecond.path.filename());
+        });
+        std::vector<std::string> theNames;
+        std::vector<size_t> theSizes;
+        for(auto& theFile: theFiles){
+            std::string theName = theFile.path.string();
+            if(std::filesystem::equivalent(theFile.path, arcPath, theError)){ continue; }
+            if(arcTOC.getEntry(theName)){
+                notifyObservers(ActionType::added, theName, false);
+                continue;
             }
-            std::string nonConstName = std::string(aFilename);
-            arcTOC.addBlockMeta(nonConstName, thePos);
+            theNames.push_back(theName);
+            theSizes.push_back(theFile.size);
         }
-        arcFileStream.seekp(0,std::ios::beg);
-        theStream.close();
-        notifyObservers(ActionType::added, aFilename, true);
+        if(theNames.empty()){ return ArchiveStatus<bool>(true); }
+        markDirty();
+
+        /* one region at the end for the whole batch, cut into a slice per file in sorted order. Processed sizes are
+         * only known once a file is packed, and slices sized by an estimate would leave holes all over the region,
+         * so processed files are placed by the allocator instead
+         */
+        std::vector<Extent> theSlices;
+        if(!aProcessor){ theSlices = appendSlices(theNames, theSizes); }
+        auto theEntries = packBatch(theNames, aProcessor, aThreadCount, theSlices);
+
+        ArchiveErrors theResult = ArchiveErrors::noError;
+        for(size_t i=0; i<theNames.size(); i++){
+            if(theEntries[i].isOK()){ arcTOC.addEntry(theNames[i], theEntries[i].getValue()); }
+            else if(theResult == ArchiveErrors::noError){ theResult = theEntries[i].getError(); }
+            notifyObservers(ActionType::added, theNames[i], theEntries[i].isOK());
+        }
+        if(theResult != ArchiveErrors::noError){ return ArchiveStatus<bool>(theResult); }
         return ArchiveStatus<bool>(true);
     }
 
     ArchiveStatus<bool> Archive::extract(const std::string &aFilename, const std::string &aFullPath){
-        // lookup filename in TOC, then iterate over all linked blocks using header.nextBlockIndex
-        auto theFileMode = std::fstream::binary | std::fstream::out;
-        std::fstream theStream;
-        theStream.open(aFullPath, theFileMode);
-        auto theLoc = theStream.tellp();
-        auto theLoc2 = theStream.tellg();
+        std::lock_guard<std::recursive_mutex> theLock(arcOperationMutex);
+        // lookup filename in TOC, then read the file's extents in large batches instead of following header links
         auto fullFilenamePath = aFilename;
         if(fullFilenamePath.find(arcFolder) == std::string::npos){ fullFilenamePath = arcFolder + "/" + aFilename; }
-        // get the starting block index of all blocks that contain the file that is requested
-        auto blockIndex = arcTOC.getBlockIndex(fullFilenamePath);
-        std::string destFilePath{aFullPath};
-        int c = 0;
-        while(true){
-            Block theBlock;
-            auto theStatus = arcBlockHandler.getAsBlock(theBlock, blockIndex,
-                                                        arcFileStream, blockIndex, *this, StreamType::Archive);
-            theStatus.getValue(); // does error checking
-
-            // if the block was processed, write it to a temp file, then (later) read that in, reverse the processing,
-            // and write to the desired input filename
-            if(theBlock.header.isProcessed && c==0) {
-                theStream.close();
-                destFilePath.insert(aFullPath.length()-4,"_reverse_process");
-                theStream.open(destFilePath, theFileMode);
-                theStream.seekp(0,std::ios::beg);
-            }
-
-            // streamPos doesn't need to be updated as it simply keeps moving along the stream as data is written to it
-            auto theWriteStatus = arcBlockHandler.writeToStream(theBlock, 0,
-                                                                theStream, blockIndex, *this, StreamType::NonArchive);
-            // terminating condition is if there is no next block for the requested file
-            if(theBlock.header.nextBlockIndex == theBlock.header.blockIndex){
-
-                //------------------ Reverse Processing --------------------
-                // if a file was processed when adding, find which processor was called and reverse the processing
-                if(theBlock.header.isProcessed) {
-                    IDataProcessor *aProcessor = nullptr;
-                    ProcessorType processorType = arcBlockHandler.getProcessorType(
-                            theBlock.header.processorType); // returns enum class type
-                    switch (processorType) {
-                        case ProcessorType::Compression:
-                            aProcessor = new Compression();
-                            break;
+        const TOCEntry* theEntry = arcTOC.getEntry(fullFilenamePath);
+        if(!theEntry){
+            notifyObservers(ActionType::extracted, aFilename, false);
+            return ArchiveStatus<bool>(ArchiveErrors::fileNotFound);
+        }
+        std::ofstream theStream(aFullPath, std::ios::binary | std::ios::trunc);
+        if(!theStream){
+            notifyObservers(ActionType::extracted, aFilename, false);
+            return ArchiveStatus<bool>(ArchiveErrors::fileOpenError);
+        }
+        auto fail = [&](ArchiveErrors anError){
+            notifyObservers(ActionType::extracted, aFilename, false);
+            return ArchiveStatus<bool>(anError);
+        };
+        auto theStatus = unpackEntry(*theEntry, [&theStream](const char* aData, size_t aLength){
+            return static_cast<bool>(theStream.write(aData, aLength));
+        });
+        if(!theStatus.isOK()){ return fail(theStatus.getError()); }
+        theStream.close();
+        if(theStream.fail()){ return fail(ArchiveErrors::fileWriteError); }
+
+        notifyObservers(ActionType::extracted, aFilename, true);
+        return ArchiveStatus<bool>(true);
+    }
+
+    ArchiveStatus<bool> Archive::unpackEntry(const TOCEntry &anEntry,
+                                             const std::function<bool(const char*, size_t)> &aWriter){
+        // processed payloads are undone on the fly, block by block, as they come out of the archive
+        auto theFirstView = arcBlockHandler.getBlockView(anEntry.getFirstBlock(), *this);
+        if(!theFirstView.isOK()){ return ArchiveStatus<bool>(ArchiveErrors::fileReadError); }
+        std::unique_ptr<IDataStream> theTransform;
+        if(theFirstView.getValue().header->isProcessed){
+            auto theProcessor = arcBlockHandler.getProcessor(theFirstView.getValue().header->processorType, *this);
+            if(!theProcessor.isOK()){ return ArchiveStatus<bool>(theProcessor.getError()); }
+            theTransform = theProcessor.getValue()->makeReverseStream();
+        }
+        std::string theOutput;
+        ArchiveErrors theError = ArchiveErrors::noError;
+        auto theStatus = visitStored(anEntry, 0, [&](const char* aData, size_t aLength){
+            if(theTransform){
+                theOutput.clear();
+                auto thePushStatus = theTransform->push(aData, aLength, false, theOutput);
+                if(!thePushStatus.isOK()){
+                    theError = thePushStatus.getError();
+                    return false;
+                }
+                aData = theOutput.data();
+                aLength = theOutput.size();
+            }
+            if(aLength && !aWriter(aData, aLength)){
+                theError = ArchiveErrors::fileWriteError;
+                return false;
+            }
+            return true;
+        });
+        if(!theStatus.isOK()){ return theStatus; }
+        if(theError != ArchiveErrors::noError){ return ArchiveStatus<bool>(theError); }
+        if(theTransform){
+            theOutput.clear();
+            auto thePushStatus = theTransform->push(nullptr, 0, true, theOutput);
+            if(!thePushStatus.isOK()){ return thePushStatus; }
+            if(!theOutput.empty() && !aWriter(theOutput.data(), theOutput.size())){
+                return ArchiveStatus<bool>(ArchiveErrors::fileWriteError);
+            }
+        }
+        return ArchiveStatus<bool>(true);
+    }
+
+    ArchiveStatus<bool> Archive::extractFolder(const std::string &aFolderName, const std::string &anExtractPath,
+                                               size_t aThreadCount){
+        std::lock_guard<std::recursive_mutex> theLock(arcOperationMutex);
+        // the folder is a prefix of the stored names; like extract(), a relative one is looked for in the archive's folder
+        auto findEntries = [this](std::string aPrefix){
+            while(aPrefix.size() > 1 && aPrefix.back() == '/'){ aPrefix.pop_back(); }
+            std::vector<std::pair<std::string, const TOCEntry*>> theEntries;
+            aPrefix += '/';
+            auto [theFirst, theLast] = arcTOC.findPrefix(aPrefix);
+            for(size_t i=theFirst; i<theLast; i++){
+                size_t theIndex = arcTOC.getSorted(i);
+                theEntries.push_back({std::string(arcTOC.getName(theIndex).substr(aPrefix.size())),
+                                      &arcTOC.getEntryAt(theIndex)});
+            }
+            return theEntries;
+        };
+        auto theEntries = findEntries(aFolderName);
+        if(theEntries.empty() && aFolderName.find(arcFolder) == std::string::npos){
+            theEntries = findEntries(arcFolder + "/" + aFolderName);
+        }
+        if(theEntries.empty()){ return ArchiveStatus<bool>(ArchiveErrors::fileNotFound); }
+
+        std::sort(theEntries.begin(), theEntries.end(), [](const auto &aFirst, const auto &aSecond){
+            return aFirst.second->getFirstBlock() < aSecond.second->getFirstBlock();
+        });
+        std::vector<std::filesystem::path> theTargets;
+        std::set<std::filesystem::path> theFolders;
+        for(auto& [theName, theEntry]: theEntries){
+            theTargets.push_back(std::filesystem::path(anExtractPath) / theName);
+            theFolders.insert(theTargets.back().parent_path());
+        }
+        std::error_code theError;
+        for(auto& theFolder: theFolders){
+            if(!std::filesystem::create_directories(theFolder, theError) && theError){
+                return ArchiveStatus<bool>(ArchiveErrors::badPath);
+            }
+        }
+
+        // workers read straight from the mapping, so it has to cover the archive before they start
+        if(!aThreadCount){ aThreadCount = std::max(1u, std::thread::hardware_concurrency()); }
+        bool isMapped = arcFile.getView(0, arcBlockHandler.getBlockOffset(arcNumBlocks)) != nullptr;
+        if(!isMapped){ aThreadCount = 1; }
+        aThreadCount = std::min(aThreadCount, theEntries.size());
+        std::vector<ArchiveErrors> theResults(theEntries.size(), ArchiveErrors::noError);
+        std::atomic<size_t> theNextEntry{0};
+        auto extractFiles = [&](){
+            for(size_t i; (i = theNextEntry++) < theEntries.size();){
+                const TOCEntry &theEntry = *theEntries[i].second;
+                int theFd = ::open(theTargets[i].c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+                if(theFd < 0){
+                    theResults[i] = ArchiveErrors::fileOpenError;
+                    continue;
+                }
+                // an unprocessed file is exactly its stored size; a failed preallocation only costs the speedup
+                auto theFirstView = arcBlockHandler.getBlockView(theEntry.getFirstBlock(), *this);
+                bool isRaw = theFirstView.isOK() && !theFirstView.getValue().header->isProcessed;
+                if(isRaw && theEntry.storedSize){ ::posix_fallocate(theFd, 0, theEntry.storedSize); }
+                // the pieces of an unprocessed file point into the mapping, which stays put until the workers are
+                // done, so their writes are queued on the backend instead of waited for one by one
+                bool isQueued = isRaw && isMapped;
+                IOBatch theWrites(arcFile.getBackend());
+                std::vector<IORequest> theRequests;
+                off_t theOffset = 0;
+                auto theStatus = unpackEntry(theEntry, [&](const char* aData, size_t aLength){
+                    if(isQueued){
+                        theRequests.push_back(IORequest{true, theFd, const_cast<char*>(aData), aLength,
+                                                        static_cast<size_t>(theOffset)});
+                        theOffset += aLength;
+                        if(theRequests.size() == kIOQueueDepth){
+                            theWrites.submit(theRequests.data(), theRequests.size());
+                            theRequests.clear();
+                        }
+                        return true;
+                    }
+                    while(aLength){
+                        ssize_t theCount = ::pwrite(theFd, aData, aLength, theOffset);
+                        if(theCount <= 0){ return false; }
+                        aData += theCount;
+                        aLength -= theCount;
+                        theOffset += theCount;
                     }
-                    theStream.close();
-                    aProcessor->reverseProcess(aFullPath);
-                    delete aProcessor;
+                    return true;
+                });
+                theWrites.submit(theRequests.data(), theRequests.size());
+                bool areWritesOK = theWrites.wait();
+                if(!theStatus.isOK()){ theResults[i] = theStatus.getError(); }
+                else if(!areWritesOK || ::ftruncate(theFd, theOffset) != 0){ theResults[i] = ArchiveErrors::fileWriteError; }
+                if(::close(theFd) != 0 && theResults[i] == ArchiveErrors::noError){
+                    theResults[i] = ArchiveErrors::fileCloseError;
                 }
-                //----------------- End reverse processing -------------------
+            }
+        };
+        std::vector<std::thread> theWorkers;
+        for(size_t i=1; i<aThreadCount; i++){ theWorkers.emplace_back(extractFiles); }
+        extractFiles();
+        for(auto& theWorker: theWorkers){ theWorker.join(); }
 
-                notifyObservers(ActionType::extracted, aFilename, true);
-                theStream.close();
-                return ArchiveStatus<bool>(true);
+        ArchiveErrors theResult = ArchiveErrors::noError;
+        for(size_t i=0; i<theEntries.size(); i++){
+            if(theResult == ArchiveErrors::noError){ theResult = theResults[i]; }
+            notifyObservers(ActionType::extracted, theEntries[i].first, theResults[i] == ArchiveErrors::noError);
+        }
+        if(theResult != ArchiveErrors::noError){ return ArchiveStatus<bool>(theResult); }
+        return ArchiveStatus<bool>(true);
+    }
+
+    ArchiveStatus<bool> Archive::visitStored(const TOCEntry &anEntry, uint64_t aStoredOffset,
+                                             const std::function<bool(const char*, size_t)> &aVisitor){
+        return visitRaw(anEntry, aStoredOffset + anEntry.getNameRecordSize(), aVisitor);
+    }
+
+    ArchiveStatus<bool> Archive::visitRaw(const TOCEntry &anEntry, uint64_t aRawOffset,
+                                          const std::function<bool(const char*, size_t)> &aVisitor){
+        size_t thePayloadSize = arcBlockHandler.getPayloadSize();
+        size_t theBlockSize = getBlockSize();
+        size_t theSkip = aRawOffset / thePayloadSize; // whole blocks before the offset
+        size_t theOffset = aRawOffset % thePayloadSize;
+        for(auto& theExtent: anEntry.extents){
+            if(theSkip >= theExtent.count){
+                theSkip -= theExtent.count;
+                continue;
+            }
+            size_t thePos = theExtent.start + theSkip;
+            theSkip = 0;
+            while(thePos < theExtent.getEnd()){
+                size_t theCount = std::min(kMaxBlocksPerRead, static_cast<size_t>(theExtent.getEnd() - thePos));
+                auto theRun = arcBlockHandler.getBlockRun(thePos, theCount, *this);
+                if(!theRun.isOK()){ return ArchiveStatus<bool>(theRun.getError()); }
+                theCount = theRun.getValue().count;
+                for(size_t i=0; i<theCount; i++){
+                    const char* theRawBlock = theRun.getValue().data + i * theBlockSize;
+                    const Header &theHeader = *reinterpret_cast<const Header*>(theRawBlock);
+                    if(!arcBlockHandler.isBlockIntact(theRawBlock)){ return ArchiveStatus<bool>(ArchiveErrors::badBlockHash); }
+                    size_t theLength = std::min<size_t>(theHeader.blockDataLen, thePayloadSize);
+                    if(theOffset < theLength && !aVisitor(theRawBlock + headerSize + theOffset, theLength - theOffset)){
+                        return ArchiveStatus<bool>(true);
+                    }
+                    theOffset = 0;
+                }
+                thePos += theCount;
+            }
+        }
+        return ArchiveStatus<bool>(true);
+    }
+
+    ArchiveStatus<size_t> Archive::readRange(const std::string &aFilename, size_t anOffset, size_t aLength,
+                                             char *aBuffer){
+        std::lock_guard<std::recursive_mutex> theLock(arcOperationMutex);
+        auto fullFilenamePath = aFilename;
+        if(fullFilenamePath.find(arcFolder) == std::string::npos){ fullFilenamePath = arcFolder + "/" + aFilename; }
+        const TOCEntry* theEntry = arcTOC.getEntry(fullFilenamePath);
+        if(!theEntry){ return ArchiveStatus<size_t>(ArchiveErrors::fileNotFound); }
+        auto theFirstView = arcBlockHandler.getBlockView(theEntry->getFirstBlock(), *this);
+        if(!theFirstView.isOK()){ return ArchiveStatus<size_t>(theFirstView.getError()); }
+        const Header theFirstHeader = *theFirstView.getValue().header;
+
+        size_t theCopied = 0;
+        auto copyOut = [&](const char* aData, size_t aSize){
+            size_t theCount = std::min(aSize, aLength - theCopied);
+            std::memcpy(aBuffer + theCopied, aData, theCount);
+            theCopied += theCount;
+            return theCopied < aLength;
+        };
+        if(!aLength){ return ArchiveStatus<size_t>(0); }
+        if(!theFirstHeader.isProcessed){
+            // stored bytes are the file bytes
+            if(anOffset >= theEntry->storedSize){ return ArchiveStatus<size_t>(0); }
+            auto theStatus = visitStored(*theEntry, anOffset, copyOut);
+            if(!theStatus.isOK()){ return ArchiveStatus<size_t>(theStatus.getError()); }
+            return ArchiveStatus<size_t>(theCopied);
+        }
+
+        // processed: undo the processing from the last seek point at or before anOffset (or from the very start)
+        auto theProcessor = arcBlockHandler.getProcessor(theFirstHeader.processorType, *this);
+        if(!theProcessor.isOK()){ return ArchiveStatus<size_t>(theProcessor.getError()); }
+        uint64_t theRawOffset = 0;
+        uint64_t theStoredOffset = 0;
+        std::unique_ptr<IDataStream> theTransform;
+        auto thePoint = std::upper_bound(theEntry->seekPoints.begin(), theEntry->seekPoints.end(), anOffset,
+                                         [](size_t aValue, const SeekPoint &aPoint){ return aValue < aPoint.rawOffset; });
+        if(thePoint != theEntry->seekPoints.begin()){
+            --thePoint;
+            theTransform = theProcessor.getValue()->makeSeekStream();
+            theRawOffset = thePoint->rawOffset;
+            theStoredOffset = thePoint->storedOffset;
+        }
+        if(!theTransform){
+            theTransform = theProcessor.getValue()->makeReverseStream();
+            theRawOffset = theStoredOffset = 0;
+        }
+        std::string theOutput;
+        ArchiveErrors theError = ArchiveErrors::noError;
+        auto theStatus = visitStored(*theEntry, theStoredOffset, [&](const char* aData, size_t aSize){
+            theOutput.clear();
+            auto thePushStatus = theTransform->push(aData, aSize, false, theOutput);
+            if(!thePushStatus.isOK()){
+                theError = thePushStatus.getError();
+                return false;
             }
-            blockIndex = theBlock.header.nextBlockIndex;
-            c++;
+            // output before anOffset is only decoded to get there
+            size_t theSkip = std::min<uint64_t>(theOutput.size(), anOffset - std::min<uint64_t>(anOffset, theRawOffset));
+            theRawOffset += theOutput.size();
+            return copyOut(theOutput.data() + theSkip, theOutput.size() - theSkip);
+        });
+        if(!theStatus.isOK()){ return ArchiveStatus<size_t>(theStatus.getError()); }
+        if(theError != ArchiveErrors::noError){ return ArchiveStatus<size_t>(theError); }
+        return ArchiveStatus<size_t>(theCopied);
+    }
+
+    void Archive::clearBlocks(const std::vector<Extent> &anExtents){
+        // the extents say which blocks to free, so blocks are only tombstoned on disk (for the recovery scan), never read
+        for(auto& theExtent: anExtents){
+            for(size_t thePos=theExtent.start; thePos<theExtent.getEnd(); thePos++){
+                Header theHeader;
+                theHeader.blockIndex = thePos;
+                theHeader.nextBlockIndex = thePos;
+                theHeader.isEmpty = true;
+                arcBlockHandler.writeHeader(theHeader, thePos, *this);
+            }
+        }
+        releaseExtents(anExtents);
+    }
+
+    // how debugDump names a chunk's blocks: kChunkNamePrefix and the digest in hex
+    static std::string getChunkName(const std::string &aDigest){
+        static const char* kHexDigits = "0123456789abcdef";
+        std::string theName(1, kChunkNamePrefix);
+        for(size_t i=0; i < aDigest.size(); i++){
+            theName += kHexDigits[static_cast<uint8_t>(aDigest[i]) >> 4];
+            theName += kHexDigits[static_cast<uint8_t>(aDigest[i]) & 0xF];
+        }
+        return theName;
+    }
+
+    ArchiveStatus<std::string> Archive::storeChunk(const char *aData, size_t aLength){
+        std::string theDigest = Sha256::digest(aData, aLength);
+        std::unique_lock<std::mutex> theLock(arcChunkMutex);
+        // a worker writing the same chunk right now publishes it (or gives up) before this one looks
+        arcChunkSignal.wait(theLock, [&](){ return !arcPendingChunks.count(theDigest); });
+        if(ChunkEntry* theChunk = arcChunks.getEntry(theDigest)){
+            theChunk->refCount++;
+            return ArchiveStatus<std::string>(theDigest);
+        }
+        arcPendingChunks.insert(theDigest);
+        theLock.unlock();
+
+        // the blocks are written without the lock, so workers storing different chunks don't wait on each other
+        Header theTemplate; // nameId is kChunkNameId and there is no name in the stream
+        BlockWriter theWriter(*this, theTemplate, aLength / arcBlockHandler.getPayloadSize() + 1);
+        auto theStatus = theWriter.write(aData, aLength);
+        auto theEntry = theStatus.isOK() ? theWriter.finish() : ArchiveStatus<TOCEntry>(theStatus.getError());
+        if(!theEntry.isOK()){ theWriter.abort(); }
+
+        theLock.lock();
+        arcPendingChunks.erase(theDigest);
+        if(theEntry.isOK()){
+            ChunkEntry theChunk;
+            theChunk.blocks = theEntry.getValue();
+            theChunk.refCount = 1;
+            arcChunks.mapChunks.emplace(theDigest, theChunk);
         }
-        notifyObservers(ActionType::extracted, aFilename, false);
-        return ArchiveStatus<bool>(ArchiveErrors::fileWriteError);
+        theLock.unlock();
+        arcChunkSignal.notify_all();
+        if(!theEntry.isOK()){ return ArchiveStatus<std::string>(theEntry.getError()); }
+        return ArchiveStatus<std::string>(theDigest);
+    }
+
+    void Archive::releaseChunk(const std::string &aDigest){
+        std::lock_guard<std::mutex> theLock(arcChunkMutex);
+        auto theChunk = arcChunks.mapChunks.find(aDigest);
+        if(theChunk == arcChunks.mapChunks.end() || --theChunk->second.refCount){ return; }
+        clearBlocks(theChunk->second.blocks.extents);
+        arcChunks.mapChunks.erase(theChunk);
+    }
+
+    ArchiveStatus<bool> Archive::visitRecipe(const TOCEntry &anEntry, const std::function<void(const std::string&)> &aVisitor){
+        std::string thePending; // a record split across blocks
+        return visitStored(anEntry, 0, [&](const char* aData, size_t aLength){
+            thePending.append(aData, aLength);
+            size_t thePos = 0;
+            for(; thePending.size() - thePos >= kRecipeRecordSize; thePos += kRecipeRecordSize){
+                aVisitor(thePending.substr(thePos, kSha256Size));
+            }
+            thePending.erase(0, thePos);
+            return true;
+        });
+    }
+
+    bool Archive::isDeduplicated(const TOCEntry &anEntry){
+        auto theFirstView = arcBlockHandler.getBlockView(anEntry.getFirstBlock(), *this);
+        if(!theFirstView.isOK() || !theFirstView.getValue().header->isProcessed){ return false; }
+        auto theType = arcBlockHandler.getProcessorType(theFirstView.getValue().header->processorType);
+        return theType.isOK() && theType.getValue() == ProcessorType::Deduplication;
     }
 
     ArchiveStatus<bool> Archive::remove(const std::string &aFilename){
+        std::lock_guard<std::recursive_mutex> theLock(arcOperationMutex);
         auto fullFilenamePath = aFilename;
         if(fullFilenamePath.find(arcFolder) == std::string::npos){ fullFilenamePath = arcFolder + "/" + aFilename; }
-        auto blockIndex = arcTOC.getBlockIndex(fullFilenamePath);
-        bool allLinkedVisited = false;
-        while(!allLinkedVisited){
-            Block theBlock;
-            auto theStatus = arcBlockHandler.getAsBlock(theBlock, blockIndex, arcFileStream, blockIndex, *this, StreamType::Archive);
-            theStatus.getValue();
-            theBlock.header.isEmpty = true;
-            theBlock.header.blockDataLen = 0;
-//            std::memset(theBlock.header.blockFileName, nullChar, sizeof(theBlock.header.blockFileName));
-            auto theWriteStatus = arcBlockHandler.writeToStream(theBlock, 0, arcFileStream, blockIndex, *this, StreamType::Archive);
-            if(theBlock.header.nextBlockIndex == theBlock.header.blockIndex){
-                notifyObservers(ActionType::removed, aFilename, true);
-                arcTOC.mapTOC.erase(fullFilenamePath);
-                return ArchiveStatus<bool>(true);
+        const TOCEntry* theEntry = arcTOC.getEntry(fullFilenamePath);
+        if(!theEntry){
+            notifyObservers(ActionType::removed, aFilename, false);
+            return ArchiveStatus<bool>(ArchiveErrors::fileNotFound);
+        }
+        markDirty();
+        // a deduplicated file gives up its share of every chunk in its recipe before the recipe itself goes
+        if(isDeduplicated(*theEntry)){
+            visitRecipe(*theEntry, [this](const std::string &aDigest){ releaseChunk(aDigest); });
+        }
+        clearBlocks(theEntry->extents);
+        arcTOC.removeEntry(fullFilenamePath);
+        notifyObservers(ActionType::removed, aFilename, true);
+        return ArchiveStatus<bool>(true);
+    }
+
+    ArchiveStatus<bool> Archive::resize(size_t aBlockSize){
+        std::lock_guard<std::recursive_mutex> theLock(arcOperationMutex);
+        if(!isValidBlockSize(aBlockSize)){ return ArchiveStatus<bool>(ArchiveErrors::badBlockLength); }
+        if(aBlockSize == getBlockSize()){ return ArchiveStatus<bool>(true); }
+        std::string theTempPath = arcPath + ".resize";
+        bool theCopyOK = true;
+        TOC theNewTOC;
+        ChunkIndex theNewChunks;
+        FreeSpaceMap theNewFreeSpace;
+        size_t theNewNumBlocks = 0;
+        Superblock theNewSuperblock;
+        {
+            // the archive is rewritten next to this one, then swapped in once every file has been repacked
+            Archive theTarget(theTempPath, AccessMode::AsNew, aBlockSize);
+            theTarget.markDirty();
+            size_t theTargetPayload = theTarget.arcBlockHandler.getPayloadSize();
+            // stored payloads are copied as is, under the name and processing flags of the source blocks
+            auto copyEntry = [&](std::string_view aName, const TOCEntry &anEntry, TOCEntry &aNewEntry){
+                auto theFirstView = arcBlockHandler.getBlockView(anEntry.getFirstBlock(), *this);
+                if(!theFirstView.isOK()){ return false; }
+                const Header &theFirstHeader = *theFirstView.getValue().header;
+                Header theTemplate;
+                theTemplate.isProcessed = theFirstHeader.isProcessed;
+                std::memcpy(theTemplate.processorType, theFirstHeader.processorType, kProcessorTypeNameSize);
+                theTemplate.nameId = theFirstHeader.nameId;
+                BlockWriter theWriter(theTarget, theTemplate,
+                                      (anEntry.getNameRecordSize() + anEntry.storedSize) / theTargetPayload + 1);
+                bool isWriteOK = aName.empty() || theWriter.writeName(aName).isOK();
+                auto theStatus = visitStored(anEntry, 0, [&](const char* aData, size_t aLength){
+                    return isWriteOK = isWriteOK && theWriter.write(aData, aLength).isOK();
+                });
+                auto theNewEntry = theWriter.finish();
+                if(!theStatus.isOK() || !isWriteOK || !theNewEntry.isOK()){ return false; }
+                aNewEntry = theNewEntry.getValue();
+                aNewEntry.seekPoints = anEntry.seekPoints; // the stored payload is unchanged, so its seek points still hold
+                return true;
+            };
+            for(auto [theName, theEntry]: arcTOC){
+                TOCEntry theNewEntry;
+                if(!(theCopyOK = copyEntry(theName, theEntry, theNewEntry))){ break; }
+                theTarget.arcTOC.addEntry(theName, theNewEntry);
+            }
+            for(auto& [theDigest, theChunk]: arcChunks.mapChunks){
+                ChunkEntry theNewChunk(theChunk);
+                if(!theCopyOK || !(theCopyOK = copyEntry("", theChunk.blocks, theNewChunk.blocks))){ break; }
+                theTarget.arcChunks.mapChunks[theDigest] = theNewChunk;
+            }
+            // the copies keep their name ids, so the target has to hand out new ones from where this archive is
+            theTarget.arcNextNameId = arcNextNameId.load();
+            theCopyOK = theCopyOK && theTarget.flush().isOK();
+            theNewTOC = theTarget.arcTOC;
+            theNewChunks = theTarget.arcChunks;
+            theNewFreeSpace = theTarget.arcFreeSpace;
+            theNewNumBlocks = theTarget.arcNumBlocks;
+            theNewSuperblock = theTarget.arcSuperblock;
+        }
+        std::error_code theError;
+        if(theCopyOK){
+            arcFile.close();
+            std::filesystem::rename(theTempPath, arcPath, theError);
+            arcFile.open(arcPath, false);
+        }
+        if(!theCopyOK || theError){
+            std::filesystem::remove(theTempPath, theError);
+            return ArchiveStatus<bool>(ArchiveErrors::fileWriteError);
+        }
+        arcTOC = theNewTOC;
+        arcChunks = theNewChunks;
+        {
+            std::lock_guard<std::mutex> theAllocationLock(arcAllocationMutex);
+            arcFreeSpace = theNewFreeSpace;
+            arcNumBlocks = theNewNumBlocks;
+        }
+        arcSuperblock = theNewSuperblock;
+        arcBlockHandler.blockSize = aBlockSize;
+        arcIsDirty = false;
+        // pages are sized after the blocks
+        if(arcFile.getPool()){ setBufferPool(arcPoolBytes); }
+        return ArchiveStatus<bool>(true);
+    }
+
+    ArchiveStatus<bool> Archive::merge(const std::string &anArchiveName){
+        std::lock_guard<std::recursive_mutex> theLock(arcOperationMutex);
+        auto theStatus = openArchive(anArchiveName);
+        if(!theStatus.isOK()){ return ArchiveStatus<bool>(theStatus.getError()); }
+        Archive &theSource = *theStatus.getValue();
+        std::error_code theError;
+        if(std::filesystem::equivalent(theSource.arcPath, arcPath, theError)){ return ArchiveStatus<bool>(ArchiveErrors::badPath); }
+        if(theSource.getBlockSize() != getBlockSize()){ return ArchiveStatus<bool>(ArchiveErrors::badBlockLength); }
+        for(auto [theName, theEntry]: theSource.arcTOC){
+            if(arcTOC.getEntry(theName)){ return ArchiveStatus<bool>(ArchiveErrors::fileExists); }
+        }
+
+        // every live block of the source is appended in order, except those of chunks this archive already holds
+        const size_t kSkipped = std::numeric_limits<size_t>::max();
+        std::vector<size_t> theNewPos(theSource.arcNumBlocks, kSkipped);
+        auto markCopied = [&](const TOCEntry &anEntry){
+            for(auto& theExtent: anEntry.extents){
+                for(size_t i=theExtent.start; i<theExtent.getEnd(); i++){ theNewPos[i] = 0; }
+            }
+        };
+        for(auto [theName, theEntry]: theSource.arcTOC){ markCopied(theEntry); }
+        for(auto& [theDigest, theChunk]: theSource.arcChunks.mapChunks){
+            if(!arcChunks.mapChunks.count(theDigest)){ markCopied(theChunk.blocks); }
+        }
+        markDirty();
+        size_t theBase = arcNumBlocks;
+        size_t theCount = 0;
+        for(auto& thePos: theNewPos){
+            if(thePos != kSkipped){ thePos = theBase + theCount++; }
+        }
+
+        // runs of copied blocks go over through one buffer, with their headers renumbered on the way
+        size_t theBlockSize = getBlockSize();
+        size_t theBufferBlocks = std::max<size_t>(kCopyBufferSize / theBlockSize, 1);
+        AlignedBuffer theBuffer(theBufferBlocks * theBlockSize);
+        std::map<uint32_t, uint32_t> theNameIds;
+        // the runs copied so far belong to nothing yet, so a failed copy gives them up and cuts them off the file,
+        // where a recovery scan would otherwise find them
+        auto fail = [&](ArchiveErrors anError){
+            {
+                std::lock_guard<std::mutex> theAllocationLock(arcAllocationMutex);
+                arcNumBlocks = theBase;
+                arcFreeSpace.truncate(theBase);
+            }
+            arcFile.truncate(arcBlockHandler.getBlockOffset(theBase));
+            notifyObservers(ActionType::added, anArchiveName, false);
+            return ArchiveStatus<bool>(anError);
+        };
+        for(size_t thePos=0; thePos<theSource.arcNumBlocks;){
+            if(theNewPos[thePos] == kSkipped){
+                thePos++;
+                continue;
+            }
+            size_t theRun = 1;
+            while(theRun < theBufferBlocks && thePos + theRun < theSource.arcNumBlocks &&
+                  theNewPos[thePos + theRun] != kSkipped){ theRun++; }
+            if(!theSource.arcFile.readAt(theBuffer.data(), theRun * theBlockSize,
+                                         theSource.arcBlockHandler.getBlockOffset(thePos))){
+                return fail(ArchiveErrors::fileReadError);
+            }
+            for(size_t i=0; i<theRun; i++){
+                Header* theHeader = reinterpret_cast<Header*>(theBuffer.data() + i * theBlockSize);
+                theHeader->blockIndex = theNewPos[thePos + i];
+                if(theHeader->nextBlockIndex < theSource.arcNumBlocks){
+                    theHeader->nextBlockIndex = theNewPos[theHeader->nextBlockIndex];
+                }
+                // the source numbered its files on its own, so they get fresh ids here
+                if(theHeader->nameId != kChunkNameId){
+                    auto [theId, isNew] = theNameIds.try_emplace(theHeader->nameId, 0);
+                    if(isNew){ theId->second = arcNextNameId++; }
+                    theHeader->nameId = theId->second;
+                }
+            }
+            if(!arcFile.writeAt(theBuffer.data(), theRun * theBlockSize,
+                                arcBlockHandler.getBlockOffset(theNewPos[thePos]))){
+                return fail(ArchiveErrors::fileWriteError);
+            }
+            {
+                std::lock_guard<std::mutex> theAllocationLock(arcAllocationMutex);
+                arcNumBlocks = theNewPos[thePos] + theRun;
+                arcFreeSpace.resize(arcNumBlocks);
+            }
+            thePos += theRun;
+        }
+
+        // extents keep their shape, only their starts move
+        auto rebase = [&](const TOCEntry &anEntry){
+            TOCEntry theEntry(anEntry);
+            for(auto& theExtent: theEntry.extents){ theExtent.start = theNewPos[theExtent.start]; }
+            return theEntry;
+        };
+        for(auto [theName, theEntry]: theSource.arcTOC){ arcTOC.addEntry(theName, rebase(theEntry)); }
+        for(auto& [theDigest, theChunk]: theSource.arcChunks.mapChunks){
+            auto theKnown = arcChunks.mapChunks.find(theDigest);
+            if(theKnown != arcChunks.mapChunks.end()){ theKnown->second.refCount += theChunk.refCount; }
+            else{
+                ChunkEntry theNewChunk(theChunk);
+                theNewChunk.blocks = rebase(theChunk.blocks);
+                arcChunks.mapChunks[theDigest] = theNewChunk;
             }
-            blockIndex = theBlock.header.nextBlockIndex;
-            theBlock.header.nextBlockIndex = theBlock.header.blockIndex;
         }
-        return ArchiveStatus<bool>(false);
+        for(auto [theName, theEntry]: theSource.arcTOC){ notifyObservers(ActionType::added, std::string(theName), true); }
+        return ArchiveStatus<bool>(true);
     }
 
-    ArchiveStatus<size_t> Archive::list(std::ostream &aStream){
-        for(auto& element: arcTOC.mapTOC){
-            auto parentPath = static_cast<std::filesystem::path>(element.first).parent_path();
-            size_t pos = std::string(parentPath).size();
-            std::string result = element.first.substr(pos + 1); // remove the / after the parent path
-            aStream << std::string(result) << std::endl;
+    ArchiveStatus<size_t> Archive::list(std::ostream &aStream, const std::string &aPrefix){
+        std::lock_guard<std::recursive_mutex> theLock(arcOperationMutex);
+        std::string thePrefix(aPrefix);
+        if(!thePrefix.empty() && thePrefix.back() == '*'){ thePrefix.pop_back(); }
+        auto theRange = arcTOC.findPrefix(thePrefix);
+        if(theRange.first == theRange.second && !thePrefix.empty() && thePrefix.find(arcFolder) == std::string::npos){
+            thePrefix = arcFolder + "/" + thePrefix;
+            theRange = arcTOC.findPrefix(thePrefix);
+        }
+        bool isFolder = !thePrefix.empty() && thePrefix.back() == '/';
+        size_t theCount = 0;
+        for(size_t i=theRange.first; i<theRange.second; theCount++){
+            std::string_view theName = arcTOC.getName(arcTOC.getSorted(i));
+            std::string_view theRest = theName.substr(theName.rfind('/') + 1); // the name without its folders
+            if(isFolder){
+                theRest = theName.substr(thePrefix.size());
+                size_t theSlash = theRest.find('/');
+                if(theSlash != std::string_view::npos){
+                    // a subfolder is listed once, and one more search skips everything in it
+                    theRest = theRest.substr(0, theSlash + 1);
+                    aStream << theRest << '\n';
+                    i = arcTOC.findPrefix(theName.substr(0, thePrefix.size() + theRest.size())).second;
+                    continue;
+                }
+            }
+            aStream << theRest << '\n';
+            i++;
         }
         aStream << "#" << std::endl;
         aStream << "#" << std::endl;
-        notifyObservers(ActionType::listed, std::string(""), true);
-        return ArchiveStatus<size_t>(arcTOC.mapTOC.size());
+        notifyObservers(ActionType::listed, aPrefix, true);
+        return ArchiveStatus<size_t>(theCount);
     }
 
     ArchiveStatus<size_t> Archive::debugDump(std::ostream &aStream){
-        size_t numBlocksArc = getStreamNumBlocks(arcFileStream) - 1;
+        std::lock_guard<std::recursive_mutex> theLock(arcOperationMutex);
+        size_t numBlocksArc = arcNumBlocks;
+        // headers only carry name ids, so the names of the blocks come from the index
+        std::vector<std::string_view> theNames(numBlocksArc);
+        std::vector<std::string> theChunkNames;
+        theChunkNames.reserve(arcChunks.mapChunks.size());
+        auto nameBlocks = [&theNames](const TOCEntry &anEntry, std::string_view aName){
+            for(auto& theExtent: anEntry.extents){
+                for(size_t i=theExtent.start; i<theExtent.getEnd() && i<theNames.size(); i++){ theNames[i] = aName; }
+            }
+        };
+        for(auto [theName, theEntry]: arcTOC){ nameBlocks(theEntry, theName); }
+        for(auto& [theDigest, theChunk]: arcChunks.mapChunks){
+            theChunkNames.push_back(getChunkName(theDigest));
+            nameBlocks(theChunk.blocks, theChunkNames.back());
+        }
         for(size_t thePos=0; thePos<numBlocksArc; thePos++){
-            Block theBlock;
-            auto theStatus = arcBlockHandler.getAsBlock(theBlock,0,arcFileStream,
-                                                        thePos,*this,StreamType::Archive);
-
-            auto parentPath = static_cast<std::filesystem::path>(theBlock.header.blockFileName).parent_path();
-            size_t pos = std::string(parentPath).size();
-//            std::cout << numBlocksArc << " " << theBlock.header.blockIndex << " " << theBlock.header.nextBlockIndex << " " << theBlock.header.blockFileName << " " << pos << std::endl;
-            std::string fileName = std::string(theBlock.header.blockFileName).substr(pos+1);
-            aStream << theBlock.header.blockIndex << " " << theBlock.header.isEmpty << " " << fileName << "\n";
+            // only the header is needed, so look at it in place instead of copying the block
+            Header theHeader;
+            if(auto theView = arcBlockHandler.getBlockView(thePos, *this); theView.isOK()){
+                theHeader = *theView.getValue().header;
+            }
+            std::string_view fileName = theNames[thePos];
+            fileName = fileName.substr(fileName.rfind('/') + 1); // without its folders
+            aStream << theHeader.blockIndex << " " << static_cast<bool>(theHeader.isEmpty) << " " << fileName << "\n";
         }
 
         notifyObservers(ActionType::dumped, std::string(""), true);
@@ -363,23 +2173,301 @@ namespace ECE141 {
     }
 
     ArchiveStatus<size_t> Archive::compact(){
-        size_t numBlocksArc = getStreamNumBlocks(arcFileStream);
-        std::fstream newArcFileStream;
-        size_t ix = 0;
-        for(size_t thePos=0; thePos<numBlocksArc; thePos++){
-            Block theBlock;
-            arcBlockHandler.getAsBlock(theBlock, thePos, arcFileStream, thePos, *this, StreamType::Archive);
-            if(theBlock.header.isEmpty){}
-            else{
-                arcBlockHandler.writeToStream(theBlock, ix, newArcFileStream, ix, *this, StreamType::Archive);
-                ix++;
+        std::lock_guard<std::recursive_mutex> theLock(arcOperationMutex);
+        size_t theLiveCount = arcNumBlocks - arcFreeSpace.getFreeCount();
+        if(arcFreeSpace.getFreeCount()){
+            markDirty();
+            // live blocks keep their order and slide down over the free ones, so a block's new position is its old one
+            // minus the free blocks below it; per-word prefix counts of the bitmap make that O(1)
+            const auto &theBitmap = arcFreeSpace.bitmap;
+            std::vector<size_t> theFreeBefore(theBitmap.size() + 1, 0);
+            for(size_t i=0; i<theBitmap.size(); i++){
+                theFreeBefore[i + 1] = theFreeBefore[i] + __builtin_popcountll(theBitmap[i]);
             }
+            auto getNewPos = [&](size_t aPos){
+                uint64_t theBelowMask = (uint64_t(1) << (aPos % 64)) - 1;
+                return aPos - theFreeBefore[aPos / 64] - __builtin_popcountll(theBitmap[aPos / 64] & theBelowMask);
+            };
+            size_t theFirstHole = 0;
+            while(!arcFreeSpace.isFree(theFirstHole)){ theFirstHole++; }
+
+            // blocks in front of the first hole stay put; only the last block of an extent can link past the hole
+            auto patchLinks = [&](const TOCEntry &anEntry){
+                for(size_t i=0; i + 1 < anEntry.extents.size(); i++){
+                    size_t theLast = anEntry.extents[i].getEnd() - 1;
+                    size_t theNext = anEntry.extents[i + 1].start;
+                    if(theLast >= theFirstHole || theNext < theFirstHole){ continue; }
+                    auto theView = arcBlockHandler.getBlockView(theLast, *this);
+                    if(!theView.isOK()){ return false; }
+                    Header theHeader = *theView.getValue().header;
+                    theHeader.nextBlockIndex = getNewPos(theNext);
+                    if(!arcBlockHandler.writeHeader(theHeader, theLast, *this).isOK()){ return false; }
+                }
+                return true;
+            };
+            for(auto [theName, theEntry]: arcTOC){
+                if(!patchLinks(theEntry)){ return ArchiveStatus<size_t>(ArchiveErrors::fileWriteError); }
+            }
+            for(auto& [theDigest, theChunk]: arcChunks.mapChunks){
+                if(!patchLinks(theChunk.blocks)){ return ArchiveStatus<size_t>(ArchiveErrors::fileWriteError); }
+            }
+
+            // everything after it moves: copy runs of live blocks lowest first through a fixed-size buffer, fixing the
+            // headers on the way; the destination is always below the source, so no block is overwritten before it is read
+            size_t theBlockSize = getBlockSize();
+            size_t theBufferBlocks = std::max<size_t>(kCopyBufferSize / theBlockSize, 1);
+            AlignedBuffer theBuffer(theBufferBlocks * theBlockSize);
+            for(size_t thePos=theFirstHole; thePos<arcNumBlocks;){
+                if(arcFreeSpace.isFree(thePos)){
+                    thePos++;
+                    continue;
+                }
+                size_t theCount = 1;
+                while(theCount < theBufferBlocks && thePos + theCount < arcNumBlocks &&
+                      !arcFreeSpace.isFree(thePos + theCount)){ theCount++; }
+                size_t theNewPos = getNewPos(thePos);
+                if(!arcFile.readAt(theBuffer.data(), theCount * theBlockSize, arcBlockHandler.getBlockOffset(thePos))){
+                    return ArchiveStatus<size_t>(ArchiveErrors::fileReadError);
+                }
+                for(size_t i=0; i<theCount; i++){
+                    Header* theHeader = reinterpret_cast<Header*>(theBuffer.data() + i * theBlockSize);
+                    theHeader->blockIndex = theNewPos + i;
+                    if(theHeader->nextBlockIndex < arcNumBlocks){ theHeader->nextBlockIndex = getNewPos(theHeader->nextBlockIndex); }
+                }
+                if(!arcFile.writeAt(theBuffer.data(), theCount * theBlockSize, arcBlockHandler.getBlockOffset(theNewPos))){
+                    return ArchiveStatus<size_t>(ArchiveErrors::fileWriteError);
+                }
+                thePos += theCount;
+            }
+
+            // the TOC and the chunk index move along in the same pass; extents that now touch are merged
+            auto relocate = [&](TOCEntry &anEntry){
+                std::vector<Extent> theExtents;
+                for(auto& theExtent: anEntry.extents){
+                    Extent theMoved{getNewPos(theExtent.start), theExtent.count};
+                    if(!theExtents.empty() && theExtents.back().getEnd() == theMoved.start){
+                        theExtents.back().count += theMoved.count;
+                    }
+                    else{ theExtents.push_back(theMoved); }
+                }
+                anEntry.extents = theExtents;
+            };
+            for(auto [theName, theEntry]: arcTOC){ relocate(theEntry); }
+            for(auto& [theDigest, theChunk]: arcChunks.mapChunks){ relocate(theChunk.blocks); }
+
+            {
+                std::lock_guard<std::mutex> theAllocationLock(arcAllocationMutex);
+                arcNumBlocks = theLiveCount;
+                arcFreeSpace.reset(arcNumBlocks);
+            }
+            arcFile.truncate(arcBlockHandler.getBlockOffset(arcNumBlocks));
+            if(!flush().isOK()){ return ArchiveStatus<size_t>(ArchiveErrors::fileWriteError); }
         }
-        // overwrite the existing archive
-        auto theFileMode = std::fstream::binary | std::fstream::in | std::fstream::out | std::fstream::trunc;
-        newArcFileStream.open(arcPath, theFileMode);
         notifyObservers(ActionType::compacted, std::string(""), true);
-        return ArchiveStatus<size_t>(ix);
+        return ArchiveStatus<size_t>(theLiveCount);
+    }
+
+    ArchiveStatus<size_t> Archive::compactStep(size_t aMaxBlocks, size_t aMaxMillis){
+        std::lock_guard<std::recursive_mutex> theLock(arcOperationMutex);
+        releaseExtents({}); // gives up a free tail (left by a recovery scan, say), so the last block is always live
+        if(!arcFreeSpace.getFreeCount() || !aMaxBlocks){ return ArchiveStatus<size_t>(size_t(0)); }
+        markDirty();
+        auto theDeadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(aMaxMillis);
+        size_t theBlockSize = getBlockSize();
+        AlignedBuffer theBuffer;
+        size_t theMoved = 0;
+        while(theMoved < aMaxBlocks && arcFreeSpace.getFreeCount()){
+            if(aMaxMillis && std::chrono::steady_clock::now() >= theDeadline){ break; }
+            // the last block ends an extent of some file or chunk; the owner index misses it after adds, so it is
+            // scanned again, within the time left (an unfinished scan goes on in the next step)
+            size_t theIndex = 0;
+            TOCEntry* theOwner = findExtentOwner(arcNumBlocks, theIndex);
+            bool isOutOfTime = false;
+            while(!theOwner){
+                bool isFullScan = !arcOwnerScan.file && !arcOwnerScan.isInChunks;
+                if(!scanExtentOwners(theDeadline, aMaxMillis != 0)){
+                    isOutOfTime = true;
+                    break;
+                }
+                theOwner = findExtentOwner(arcNumBlocks, theIndex);
+                if(!theOwner && isFullScan){ return ArchiveStatus<size_t>(ArchiveErrors::badBlock); }
+            }
+            if(isOutOfTime){ break; }
+            ExtentOwner theOwnerKey = arcExtentOwners[arcNumBlocks];
+
+            // the tail of that extent goes to the lowest free run; every free block lies below the tail
+            Extent theExtent = theOwner->extents[theIndex];
+            Extent theTarget;
+            {
+                std::lock_guard<std::mutex> theAllocationLock(arcAllocationMutex);
+                theTarget = arcFreeSpace.allocateRun(std::min<size_t>(theExtent.count, aMaxBlocks - theMoved));
+            }
+            Extent theSource{theExtent.getEnd() - theTarget.count, theTarget.count};
+            theBuffer.resize(theSource.count * theBlockSize);
+            if(!arcFile.readAt(theBuffer.data(), theBuffer.size(), arcBlockHandler.getBlockOffset(theSource.start))){
+                return ArchiveStatus<size_t>(ArchiveErrors::fileReadError);
+            }
+            for(size_t i=0; i<theSource.count; i++){
+                Header* theHeader = reinterpret_cast<Header*>(theBuffer.data() + i * theBlockSize);
+                theHeader->blockIndex = theTarget.start + i;
+                if(theHeader->nextBlockIndex >= theSource.start && theHeader->nextBlockIndex < theSource.getEnd()){
+                    theHeader->nextBlockIndex = theHeader->nextBlockIndex - theSource.start + theTarget.start;
+                }
+            }
+            if(!arcFile.writeAt(theBuffer.data(), theBuffer.size(), arcBlockHandler.getBlockOffset(theTarget.start))){
+                return ArchiveStatus<size_t>(ArchiveErrors::fileWriteError);
+            }
+            // the block that linked to the moved run now links to the copy (the first block of a file has no such link)
+            if(theSource.start > theExtent.start || theIndex > 0){
+                size_t thePrev = theSource.start > theExtent.start ? theSource.start - 1
+                                                                   : theOwner->extents[theIndex - 1].getEnd() - 1;
+                auto theView = arcBlockHandler.getBlockView(thePrev, *this);
+                if(!theView.isOK()){ return ArchiveStatus<size_t>(ArchiveErrors::fileReadError); }
+                Header theHeader = *theView.getValue().header;
+                theHeader.nextBlockIndex = theTarget.start;
+                if(!arcBlockHandler.writeHeader(theHeader, thePrev, *this).isOK()){
+                    return ArchiveStatus<size_t>(ArchiveErrors::fileWriteError);
+                }
+            }
+
+            std::vector<Extent> theExtents;
+            for(size_t i=0; i<theOwner->extents.size(); i++){
+                std::vector<Extent> thePieces{theOwner->extents[i]};
+                if(i == theIndex){
+                    thePieces[0].count -= theSource.count;
+                    thePieces.push_back(theTarget);
+                }
+                for(auto& thePiece: thePieces){
+                    if(!thePiece.count){ continue; }
+                    if(!theExtents.empty() && theExtents.back().getEnd() == thePiece.start){
+                        theExtents.back().count += thePiece.count;
+                    }
+                    else{ theExtents.push_back(thePiece); }
+                }
+            }
+            theOwner->extents = theExtents;
+            for(auto& theNewExtent: theExtents){ arcExtentOwners[theNewExtent.getEnd()] = theOwnerKey; }
+            releaseExtents({theSource});
+            theMoved += theSource.count;
+        }
+        // the moved blocks' old copies are past the end now; cut them off so a recovery scan can't pick them up
+        arcFile.truncate(arcBlockHandler.getBlockOffset(arcNumBlocks));
+        if(theMoved){ notifyObservers(ActionType::compacted, std::string(""), true); }
+        return ArchiveStatus<size_t>(theMoved);
+    }
+
+    TOCEntry* Archive::findExtentOwner(size_t anEnd, size_t &anIndex){
+        auto theOwner = arcExtentOwners.find(anEnd);
+        if(theOwner == arcExtentOwners.end()){ return nullptr; }
+        TOCEntry* theEntry = nullptr;
+        if(!theOwner->second.isChunk){ theEntry = arcTOC.getEntry(theOwner->second.key); }
+        else if(ChunkEntry* theChunk = arcChunks.getEntry(theOwner->second.key)){ theEntry = &theChunk->blocks; }
+        // a block has one owner, so whoever still has an extent ending there is it
+        for(size_t i=0; theEntry && i<theEntry->extents.size(); i++){
+            if(theEntry->extents[i].getEnd() == anEnd){
+                anIndex = i;
+                return theEntry;
+            }
+        }
+        arcExtentOwners.erase(theOwner);
+        return nullptr;
+    }
+
+    bool Archive::scanExtentOwners(std::chrono::steady_clock::time_point aDeadline, bool hasDeadline){
+        if(!arcOwnerScan.file && !arcOwnerScan.isInChunks){ arcExtentOwners.clear(); } // drops the stale entries
+        size_t theCount = 0;
+        auto isOutOfTime = [&](){
+            return hasDeadline && !(++theCount % kOwnerScanBatch) && std::chrono::steady_clock::now() >= aDeadline;
+        };
+        auto addOwner = [this](const TOCEntry &anEntry, bool isChunk, const std::string &aKey){
+            for(auto& theExtent: anEntry.extents){ arcExtentOwners[theExtent.getEnd()] = ExtentOwner{isChunk, aKey}; }
+        };
+        for(; !arcOwnerScan.isInChunks && arcOwnerScan.file < arcTOC.size(); arcOwnerScan.file++){
+            if(isOutOfTime()){ return false; }
+            addOwner(arcTOC.getEntryAt(arcOwnerScan.file), false, std::string(arcTOC.getName(arcOwnerScan.file)));
+        }
+        arcOwnerScan.isInChunks = true;
+        // no digest is empty, so an empty cursor starts at the first chunk
+        for(auto it=arcChunks.mapChunks.upper_bound(arcOwnerScan.chunk); it!=arcChunks.mapChunks.end(); ++it){
+            if(isOutOfTime()){ return false; }
+            addOwner(it->second.blocks, true, it->first);
+            arcOwnerScan.chunk = it->first;
+        }
+        arcOwnerScan = OwnerScan();
+        return true;
+    }
+
+    double Archive::getFragmentation() const{
+        std::lock_guard<std::mutex> theLock(arcAllocationMutex); // the background compactor moves blocks meanwhile
+        return arcNumBlocks ? static_cast<double>(arcFreeSpace.getFreeCount()) / arcNumBlocks : 0.0;
+    }
+
+    void Archive::setChecksumVerification(bool shouldVerify){
+        std::lock_guard<std::recursive_mutex> theLock(arcOperationMutex);
+        arcBlockHandler.shouldVerify = shouldVerify;
+    }
+
+    ArchiveStatus<bool> Archive::setIOBackend(IOBackendType aType, size_t aQueueDepth){
+        std::lock_guard<std::recursive_mutex> theLock(arcOperationMutex);
+        auto theBackend = IOBackend::create(aType, aQueueDepth);
+        if(!theBackend){ return ArchiveStatus<bool>(ArchiveErrors::badMode); }
+        arcFile.setBackend(std::move(theBackend));
+        return ArchiveStatus<bool>(true);
+    }
+
+    ArchiveStatus<bool> Archive::setBufferPool(size_t aBytes){
+        std::lock_guard<std::recursive_mutex> theLock(arcOperationMutex);
+        size_t thePageSize = std::max(arcFile.isDirect() ? kDirectPoolPageSize : kPoolPageSize, getBlockSize());
+        size_t theFrameCount = aBytes ? std::max(kMinPoolFrames, aBytes / thePageSize) : 0;
+        if(!arcFile.setPool(kSuperblockSize, thePageSize, theFrameCount)){
+            return ArchiveStatus<bool>(ArchiveErrors::fileWriteError);
+        }
+        arcPoolBytes = aBytes;
+        return ArchiveStatus<bool>(true);
+    }
+
+    ArchiveStatus<bool> Archive::setDirectIO(bool isDirect){
+        std::lock_guard<std::recursive_mutex> theLock(arcOperationMutex);
+        if(isDirect && getBlockSize() % kDirectIOAlignment){ return ArchiveStatus<bool>(ArchiveErrors::badBlockLength); }
+        if(!arcFile.setDirect(isDirect)){ return ArchiveStatus<bool>(ArchiveErrors::badMode); }
+        if(isDirect){ return setBufferPool(arcFile.getPool() ? arcPoolBytes : kDirectPoolSize); }
+        return ArchiveStatus<bool>(true);
+    }
+
+    void Archive::startCompactor(double aThreshold, size_t aBlocksPerStep, size_t aPauseMillis){
+        stopCompactor();
+        arcCompactorStop = false;
+        arcCompactor = std::thread([this, aThreshold, aBlocksPerStep, aPauseMillis](){
+            bool isCompacting = false;
+            std::unique_lock<std::mutex> theLock(arcCompactorMutex);
+            while(!arcCompactorSignal.wait_for(theLock, std::chrono::milliseconds(aPauseMillis),
+                                               [this](){ return arcCompactorStop; })){
+                theLock.unlock();
+                {
+                    std::lock_guard<std::recursive_mutex> theOperationLock(arcOperationMutex);
+                    // once set off, keep going until no free block is left rather than hovering at the threshold
+                    if(!isCompacting){
+                        double theFragmentation = getFragmentation();
+                        isCompacting = theFragmentation > 0 && theFragmentation >= aThreshold;
+                    }
+                    if(isCompacting){
+                        isCompacting = compactStep(aBlocksPerStep, kCompactStepMillis).isOK() &&
+                                       arcFreeSpace.getFreeCount();
+                    }
+                }
+                theLock.lock();
+            }
+        });
+    }
+
+    void Archive::stopCompactor(){
+        if(!arcCompactor.joinable()){ return; }
+        {
+            std::lock_guard<std::mutex> theLock(arcCompactorMutex);
+            arcCompactorStop = true;
+        }
+        arcCompactorSignal.notify_all();
+        arcCompactor.join();
     }
 
     Archive&  Archive::addObserver(std::shared_ptr<ArchiveObserver> anObserver){
@@ -9,27 +9,73 @@
 #include <iostream>
 #include <cstring>
 #include <string>
+#include <string_view>
 #include <fstream>
 #include <vector>
 #include <memory>
 #include <set>
 #include <map>
+#include <deque>
 #include <optional>
 #include <stdexcept>
 #include <filesystem>
+#include <cstdint>
+#include <thread>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <algorithm>
+#include <limits>
+#include <type_traits>
 #include <zlib.h>
+#include "ArchiveFile.hpp"
+#include "Sha256.hpp"
+#include "Crc32c.hpp"
 
 namespace ECE141 {
 
-    const size_t kBlockSize=1024;
-    const size_t kFileNameSize = 30;
+    const size_t kBlockSize=1024; // default block size of new archives; the actual size is stored in the superblock
+    const size_t kSmallestBlockSize = 1024;
+    const size_t kLargestBlockSize = 64 * 1024 * 1024;
     const size_t kProcessorTypeNameSize = 5; // processor name MUST be only length 4 so that null terminator is not affected
     const char nullChar = '\0';
+    const size_t kMaxBlocksPerRead = 256; // upper bound on one batched read of an extent
+    const size_t kStreamChunkSize = 64 * 1024; // how much of an input file add() reads per step
+    const size_t kDeflateChunkSize = 256 * 1024; // input compressed independently by one thread in parallel deflate
+    const size_t kDeflateWindowSize = 32 * 1024; // history a chunk is primed with, the largest window deflate can use
+    const size_t kCopyBufferSize = 1024 * 1024; // copy buffer of compact() and merge(), at least one block
+    const size_t kWriteCombineSize = 4 * 1024 * 1024; // consecutive blocks a BlockWriter gathers into one write
+    const size_t kSlabSize = 256 * 1024; // most blocks a packBatch() worker reserves at a time, in bytes
+    const size_t kFirstSlabBlocks = 16; // and how many its first reservation has; each one after is twice as large
+    const size_t kPoolPageSize = 64 * 1024; // smallest page of the buffer pool; larger blocks get a page each
+    const size_t kMinPoolFrames = 8; // frames a buffer pool gets at least, so a few pinned views never starve it
+    const size_t kDirectPoolPageSize = 1024 * 1024; // pages are larger in direct mode, every miss being a device read
+    const size_t kDirectPoolSize = 16 * 1024 * 1024; // pool set up by direct mode when there is none yet
+    const size_t kCompactStepBlocks = 256; // blocks a background compaction step may move
+    const size_t kCompactStepMillis = 5; // and how long it may take
+    const size_t kOwnerScanBatch = 1024; // entries the extent owner scan goes through between looks at the clock
+    const size_t kSortedPatchLimit = 256; // adds and removes patched into the TOC's name order between prefix lookups
+    const size_t kCompactPauseMillis = 50; // between background steps
+    const double kCompactThreshold = 0.1; // share of free blocks that sets off background compaction
+    const size_t kSeekPointInterval = 1024 * 1024; // input between compression seek points, bounds readRange's inflating
+    // content-defined chunk bounds of deduplication; the average is about kMinChunkSize + 2^kChunkMaskBits
+    const size_t kMinChunkSize = 2 * 1024;
+    const size_t kMaxChunkSize = 64 * 1024;
+    const size_t kChunkMaskBits = 13;
+    const size_t kRecipeRecordSize = kSha256Size + sizeof(uint32_t); // chunk digest and chunk length
+    const char kChunkNamePrefix = '#'; // debugDump shows chunk blocks as the prefix and the digest in hex
+    const uint32_t kChunkNameId = UINT32_MAX; // nameId of every chunk block
+    const size_t kNameLengthSize = sizeof(uint32_t); // the little-endian name length heading a file's stored stream
+    const size_t kSuperblockSize = 4096; // reserved region at the start of the archive; data blocks follow it
+    const char kArchiveMagic[8] = "ECE141A";
+    const uint32_t kArchiveVersion = 10; // archives of any other version are refused
 
     enum class ActionType {added, extracted, removed, listed, dumped, compacted};
     enum class AccessMode {AsNew, AsExisting}; //you can change values (but not names) of this enum
     enum class StreamType {Archive, NonArchive};
-    enum class ProcessorType {Compression};
+    enum class ProcessorType {Compression, Deduplication};
 
     struct ArchiveObserver {
         void operator()(ActionType anAction,
@@ -93,207 +139,945 @@ namespace ECE141 {
         ArchiveErrors error;
     };
 
-    size_t getStreamNumBlocks(std::fstream& aStream, StreamType theStreamType=StreamType::Archive);
+    size_t getStreamNumBlocks(std::fstream& aStream, StreamType theStreamType=StreamType::Archive,
+                              size_t aBlockSize=kBlockSize);
+    bool isValidBlockSize(size_t aBlockSize);
 
-    struct TOC{
-        TOC() = default;
-        // maps hash of a block's filepath to its block index (use with seekg to read block's data)
-        std::map<std::string, size_t> mapTOC;
-        // hashes the block's filepath and inserts into map above
-        void addBlockMeta(std::string blockFilePath, size_t theIndex);
-        size_t getBlockIndex(std::string blockFilePath);
+    // everything on disk is little-endian; hosts of the other byte order swap on every load and store
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    constexpr bool kIsLittleEndianHost = false;
+#else
+    constexpr bool kIsLittleEndianHost = true;
+#endif
+
+    // the value's bytes in little-endian order; applied twice it gives the value back
+    template<typename T>
+    T toLittleEndian(T aValue){
+        static_assert(std::is_integral_v<T> && std::is_unsigned_v<T>, "only unsigned integers are stored");
+        if constexpr(kIsLittleEndianHost || sizeof(T) == 1){ return aValue; }
+        else{
+            T theResult = 0;
+            for(size_t i=0; i<sizeof(T); i++){ theResult = (theResult << 8) | ((aValue >> (8 * i)) & 0xFF); }
+            return theResult;
+        }
+    }
+
+    /* An integer held as its little-endian bytes. Structs made of these and chars have no padding, an alignment of 1
+     * and the same layout on every host, so they can be read and written in place; they convert to and from T like
+     * the plain integer
+     */
+    template<typename T>
+    class LittleEndian{
+    public:
+        LittleEndian(T aValue=0){ *this = aValue; }
+        LittleEndian& operator=(T aValue){
+            aValue = toLittleEndian(aValue);
+            std::memcpy(bytes, &aValue, sizeof(T));
+            return *this;
+        }
+        operator T() const{
+            T theValue;
+            std::memcpy(&theValue, bytes, sizeof(T));
+            return toLittleEndian(theValue);
+        }
+
+    private:
+        unsigned char bytes[sizeof(T)];
+    };
+
+    // helpers for the flat encodings that are persisted in the index region
+    template<typename T>
+    void appendValue(std::string &aBuffer, T aValue){
+        aValue = toLittleEndian(aValue);
+        aBuffer.append(reinterpret_cast<const char*>(&aValue), sizeof(aValue));
+    }
+
+    template<typename T>
+    bool readValue(const std::string &aBuffer, size_t &aPos, T &aValue){
+        if(aPos + sizeof(aValue) > aBuffer.size()){ return false; }
+        std::memcpy(&aValue, aBuffer.data() + aPos, sizeof(aValue));
+        aValue = toLittleEndian(aValue);
+        aPos += sizeof(aValue);
+        return true;
+    }
+
+    /* the same for arrays of records made of aFields integers of type T each (extents, bitmap words): one bulk copy
+     * on a little-endian host instead of a call per field
+     */
+    template<typename T, typename R>
+    void appendValues(std::string &aBuffer, const R* aRecords, size_t aCount){
+        static_assert(sizeof(R) % sizeof(T) == 0, "records must be made of whole fields");
+        if(!aCount){ return; }
+        size_t thePos = aBuffer.size();
+        aBuffer.append(reinterpret_cast<const char*>(aRecords), aCount * sizeof(R));
+        if constexpr(!kIsLittleEndianHost){
+            for(size_t i=0; i<aCount * sizeof(R) / sizeof(T); i++, thePos += sizeof(T)){
+                T theValue;
+                std::memcpy(&theValue, aBuffer.data() + thePos, sizeof(T));
+                theValue = toLittleEndian(theValue);
+                std::memcpy(aBuffer.data() + thePos, &theValue, sizeof(T));
+            }
+        }
+    }
+
+    template<typename T, typename R>
+    bool readValues(const std::string &aBuffer, size_t &aPos, R* aRecords, size_t aCount){
+        static_assert(sizeof(R) % sizeof(T) == 0, "records must be made of whole fields");
+        if(aCount > (aBuffer.size() - std::min(aPos, aBuffer.size())) / sizeof(R)){ return false; }
+        if(!aCount){ return true; }
+        char* theTarget = reinterpret_cast<char*>(aRecords);
+        std::memcpy(theTarget, aBuffer.data() + aPos, aCount * sizeof(R));
+        if constexpr(!kIsLittleEndianHost){
+            for(size_t i=0; i<aCount * sizeof(R) / sizeof(T); i++){
+                T theValue;
+                std::memcpy(&theValue, theTarget + i * sizeof(T), sizeof(T));
+                theValue = toLittleEndian(theValue);
+                std::memcpy(theTarget + i * sizeof(T), &theValue, sizeof(T));
+            }
+        }
+        aPos += aCount * sizeof(R);
+        return true;
+    }
+
+    // a run of physically contiguous blocks
+    struct Extent{
+        uint64_t start;
+        uint64_t count;
+        uint64_t getEnd() const { return start + count; }
+    };
+
+    /* a place in a processed file where its reverse stream can start from scratch, given as an offset into the
+     * original data and the matching offset into the stored (processed) payload
+     */
+    struct SeekPoint{
+        uint64_t rawOffset;
+        uint64_t storedOffset;
+    };
+
+    // a file's blocks in chain order, stored as contiguous runs so they can be read or freed per run
+    struct TOCEntry{
+        TOCEntry() : storedSize(0), nameLength(0) {}
+        std::vector<Extent> extents;
+        uint64_t storedSize; // payload bytes held by the blocks (after processing)
+        /* a file's stored stream starts with its name length and its name, so the recovery scan can name the file
+         * without the index; storedSize leaves them out. 0 for chunks, which have no name. Not part of the entry
+         * encoding: the TOC restores it from the name it keeps anyway
+         */
+        uint32_t nameLength;
+        std::vector<SeekPoint> seekPoints; // ascending; empty if the file is not processed or the processor has none
+        size_t getFirstBlock() const { return extents.empty() ? 0 : extents.front().start; }
+        // stream bytes in front of the stored payload
+        uint64_t getNameRecordSize() const { return nameLength ? kNameLengthSize + nameLength : 0; }
+        size_t getBlockCount() const;
+        // appends a block, growing the last extent when the block continues it
+        void addBlock(size_t aBlockIndex);
+        // stored size, extents and seek points in the index encoding
+        void serialize(std::string &anOutput) const;
+        bool deserialize(const std::string &anInput, size_t &aPos);
     };
 
+    /* Maps a file's full path to the extents holding its blocks. Entries and their names sit in dense arrays (the
+     * names interned back to back in one arena) under an open-addressing table of entry numbers, so a lookup hashes
+     * the name once and probes a few adjacent slots. Removing an entry moves the last one into its place, so entry
+     * pointers and iteration order only hold until the next add or remove
+     */
+    class TOC{
+    public:
+        template<typename TOCType, typename EntryType>
+        class Iterator{
+        public:
+            Iterator(TOCType *aTOC, size_t anIndex) : toc(aTOC), index(anIndex) {}
+            std::pair<std::string_view, EntryType&> operator*() const {
+                return {toc->getName(index), toc->entries[index]};
+            }
+            Iterator& operator++() { index++; return *this; }
+            bool operator!=(const Iterator &anOther) const { return index != anOther.index; }
+        protected:
+            TOCType *toc;
+            size_t index;
+        };
+        using iterator = Iterator<TOC, TOCEntry>;
+        using const_iterator = Iterator<const TOC, const TOCEntry>;
+
+        // false (and no change) if the name is taken
+        bool addEntry(std::string_view aName, const TOCEntry &anEntry);
+        // nullptr if there is no such file
+        const TOCEntry* getEntry(std::string_view aName) const;
+        TOCEntry* getEntry(std::string_view aName);
+        bool removeEntry(std::string_view aName);
+        void clear();
+        size_t size() const { return entries.size(); }
+        std::string_view getName(size_t anIndex) const {
+            return std::string_view(arena.data() + names[anIndex].offset, names[anIndex].length);
+        }
+        const TOCEntry& getEntryAt(size_t anIndex) const { return entries[anIndex]; }
+        /* positions [first, last) in name order of the entries whose names start with aPrefix, found by binary search.
+         * Adds and removes keep the name order up to date with a binary search each; after more than
+         * kSortedPatchLimit of them without a lookup in between (a bulk load, say), they stop and the next call
+         * sorts once instead
+         */
+        std::pair<size_t, size_t> findPrefix(std::string_view aPrefix) const;
+        // the entry number at aPosition in name order (as returned by findPrefix)
+        size_t getSorted(size_t aPosition) const { return sorted[aPosition]; }
+        iterator begin() { return iterator(this, 0); }
+        iterator end() { return iterator(this, entries.size()); }
+        const_iterator begin() const { return const_iterator(this, 0); }
+        const_iterator end() const { return const_iterator(this, entries.size()); }
+
+        // flat encoding of the entries that is persisted in the index region of the archive
+        void serialize(std::string &anOutput) const;
+        bool deserialize(const std::string &anInput, size_t &aPos);
+
+    protected:
+        struct Name{
+            size_t offset; // into arena
+            size_t length;
+            size_t hash;
+        };
+        static constexpr uint32_t kEmptySlot = UINT32_MAX;
+
+        // the slot holding entry anIndex, or the empty slot where a name with that hash and text would go
+        size_t findSlot(std::string_view aName, size_t aHash) const;
+        size_t findSlotOf(size_t anIndex) const;
+        void rehash(size_t aSlotCount);
+        void reserve(size_t aCount);
+        // where aName is, or would go, in sorted
+        size_t findSorted(std::string_view aName) const;
+
+        std::vector<TOCEntry> entries;
+        std::vector<Name> names; // parallel to entries
+        std::string arena;
+        size_t arenaGarbage = 0; // bytes of removed names still in arena
+        std::vector<uint32_t> slots; // a power of two in size, at most 3/4 full
+        mutable std::vector<uint32_t> sorted; // entry numbers in name order
+        mutable bool isSortedStale = false;
+        mutable size_t sortedPatches = 0; // adds and removes patched into sorted since the last lookup
+    };
+
+    // a deduplicated chunk: stored once like a file, and kept as long as some recipe refers to it
+    struct ChunkEntry{
+        ChunkEntry() : refCount(0) {}
+        TOCEntry blocks; // storedSize is the chunk length
+        uint64_t refCount;
+    };
+
+    struct ChunkIndex{
+        // keyed by the raw SHA-256 digest of the chunk contents
+        std::map<std::string, ChunkEntry> mapChunks;
+        ChunkEntry* getEntry(const std::string &aDigest);
+        // persisted in the index region after the free-space map
+        void serialize(std::string &anOutput) const;
+        bool deserialize(const std::string &anInput, size_t &aPos);
+    };
+
+    /* Free-block bitmap (a set bit marks a free block) that replaces scanning block headers for empty blocks.
+     * It is kept in memory and persisted in the index region next to the TOC. Next to it sit the maximal runs of free
+     * blocks, by start and by length, so searches, claims and releases are O(log n) in the number of runs and never
+     * walk the bitmap; the runs are rebuilt from the bitmap when it is loaded
+     */
+    struct FreeSpaceMap{
+        FreeSpaceMap();
+        void reset(size_t aNumBlocks);
+        // grows the map to cover aNumBlocks, new blocks start out as used
+        void resize(size_t aNumBlocks);
+        // best-fit search for aCount contiguous free blocks: the lowest of the shortest runs that are long enough
+        std::optional<size_t> findRun(size_t aCount) const;
+        // claims the lowest free block plus the free blocks directly after it, up to aMaxCount blocks
+        Extent allocateRun(size_t aMaxCount);
+        void claim(const Extent &anExtent);
+        void release(size_t aBlockIndex);
+        void release(const Extent &anExtent);
+        // forgets every block from aNumBlocks on
+        void truncate(size_t aNumBlocks);
+        bool isFree(size_t aBlockIndex) const;
+        size_t getFreeCount() const { return freeCount; }
+        void serialize(std::string &anOutput) const;
+        bool deserialize(const std::string &anInput, size_t &aPos);
+
+        std::vector<uint64_t> bitmap;
+        size_t numBlocks;
+        size_t freeCount;
+
+    protected:
+        // marks [aStart, anEnd) free or used in the bitmap and returns how many blocks changed
+        size_t setBits(size_t aStart, size_t anEnd, bool isFree);
+        void addRun(size_t aStart, size_t aLength);
+        void eraseRun(std::map<size_t, size_t>::iterator aRun);
+
+        std::map<size_t, size_t> runs; // start -> length of every maximal run of free blocks
+        std::set<std::pair<size_t, size_t>> runsByLength; // (length, start) of the same runs
+    };
+
+    /* Lives at offset 0 of the archive and points to the index region that follows the last data block.
+     * isClean is cleared on the first mutation of a session and set again once flush() rewrites the index,
+     * so an archive that was not closed properly falls back to the full block scan on open. Packed little-endian,
+     * like Header
+     */
+    struct Superblock{
+        Superblock();
+        char magic[sizeof(kArchiveMagic)];
+        LittleEndian<uint32_t> version;
+        LittleEndian<uint32_t> isClean;
+        LittleEndian<uint64_t> blockSize;
+        LittleEndian<uint64_t> numBlocks;
+        LittleEndian<uint64_t> indexOffset;
+        LittleEndian<uint64_t> indexLength;
+        LittleEndian<uint32_t> indexChecksum;
+    };
+
+    // starts every block; packed little-endian fields, so it is read in place from the mapped file on any host
     struct Header{
         Header();
-        size_t blockIndex;
-        size_t nextBlockIndex;
-        size_t blockDataLen;
-        bool isEmpty;
-        bool isProcessed;
+        LittleEndian<uint64_t> blockIndex;
+        LittleEndian<uint64_t> nextBlockIndex;
+        LittleEndian<uint32_t> blockDataLen; // payloads are smaller than kLargestBlockSize
+        LittleEndian<uint32_t> nameId; // which file the block belongs to (kChunkNameId for chunks); the names live in the index
+        LittleEndian<uint32_t> checksum; // crc32c() of the blockDataLen payload bytes, set when the block is written
+        uint8_t isEmpty;
+        uint8_t isProcessed;
         char processorType[kProcessorTypeNameSize];
-        char blockFileName[kFileNameSize];
     };
 
     constexpr size_t headerSize = sizeof(Header);
+    static_assert(headerSize == 35 && alignof(Header) == 1, "Header must stay packed");
+    static_assert(sizeof(Superblock) == 52 && sizeof(Superblock) <= kSuperblockSize, "Superblock must stay packed");
 
+    // the payload size depends on the block size of the archive, so it lives on the heap
     struct Block {
-        Block() = default;
+        Block() : Block(kBlockSize) {}
+        explicit Block(size_t aBlockSize) : data(aBlockSize - headerSize, nullChar) {}
         Header header;
-        char data[kBlockSize - headerSize];
+        std::vector<char> data;
+    };
+
+    /* a block seen in place inside the mapped archive or a pinned buffer pool frame; only valid until the archive is
+     * written to or remapped
+     */
+    struct BlockView {
+        const Header* header;
+        const char* data;
+        BufferPool::Pin pin; // keeps the frame holding the block resident while the view is around
+    };
+
+    // raw blocks back to back (block i starts at i * blockSize), count of them, and the pin holding them if pooled
+    struct BlockRun {
+        const char* data;
+        size_t count;
+        BufferPool::Pin pin;
     };
 
     class Archive; // forward declare
+    class IDataProcessor;
 
     struct BlockHandler {
-        BlockHandler() = default;
-        /* Makes a block (with complete header initialization) corresponding to a 1024 byte section from archive file
+        BlockHandler() : blockSize(kBlockSize), shouldVerify(true) {}
+        /* Makes a block (with complete header initialization) corresponding to a blockSize section from archive file
          * Defers error handling to caller
          */
         ArchiveStatus<Block> getAsBlock(Block &aBlock, size_t streamPos, std::fstream& anFStream, size_t arcPos,
                                         Archive& theArchive, StreamType theStreamType);
+        // copies the block at arcPos out of the archive; badBlockHash if its payload fails the checksum
+        ArchiveStatus<Block> getAsBlock(Block &aBlock, size_t arcPos, Archive& theArchive);
+        // the block at arcPos in place, for header inspection and reads that don't need a copy
+        ArchiveStatus<BlockView> getBlockView(size_t arcPos, Archive& theArchive);
+        /* up to aCount contiguous raw blocks starting at arcPos, normally straight from the mapped archive. With a
+         * buffer pool the run ends with the pool page it starts in; when neither is available (or the pool has no
+         * frame to spare) it is a pread of all aCount blocks into readBuffer
+         */
+        ArchiveStatus<BlockRun> getBlockRun(size_t arcPos, size_t aCount, Archive& theArchive);
         bool isBlockEmpty(Block &aBlock, size_t aPos);
-        // iterate over blocks and return indexes of empty blocks
-        std::vector<Block> getEmptyBlocks(Archive& theArchive);
+        /* whether the payload of a raw block matches its header checksum; always true for free blocks and when
+         * shouldVerify is off
+         */
+        bool isBlockIntact(const char* aRawBlock) const;
+        // overwrites only the header part of the block at arcPos; with a buffer pool it is written back later
+        ArchiveStatus<bool> writeHeader(const Header &aHeader, size_t arcPos, Archive& theArchive);
         std::vector<Block> getProcessedBlocks(Archive& theArchive);
         ArchiveStatus<Block> writeToStream(Block &aBlock, size_t streamPos, std::fstream& anFStream, size_t arcPos,
                                            Archive& theArchive, StreamType theDestinationStreamType);
-        ProcessorType getProcessorType(const char* processorName);
+        // checksums aBlock and writes header and payload to arcPos in the archive with one positional write
+        ArchiveStatus<Block> writeToStream(Block &aBlock, size_t arcPos, Archive& theArchive);
+        // badProcessor if the name stored in a header is not one this build knows how to undo
+        ArchiveStatus<ProcessorType> getProcessorType(const char* processorName);
+        // a processor able to undo what the named one did
+        ArchiveStatus<std::shared_ptr<IDataProcessor>> getProcessor(const char* processorName, Archive& theArchive);
+        // byte offset of a data block in the archive file (data blocks start after the superblock)
+        size_t getBlockOffset(size_t arcPos);
+        ArchiveStatus<Superblock> getSuperblock(Archive& theArchive);
+        ArchiveStatus<bool> writeSuperblock(Superblock &aSuperblock, Archive& theArchive);
+        // raw byte regions outside of the block area, e.g. the persisted index
+        ArchiveStatus<bool> readRegion(std::string &aBuffer, size_t anOffset, size_t aLength, Archive& theArchive);
+        ArchiveStatus<bool> writeRegion(const std::string &aBuffer, size_t anOffset, Archive& theArchive);
+        size_t getPayloadSize() const { return blockSize - headerSize; }
+
+        size_t blockSize; // set from the superblock when an archive is opened
+        bool shouldVerify; // checksums are checked on every payload read
+        AlignedBuffer readBuffer;
+    };
+
+    /* Blocks a packBatch() worker reserves from the archive in slabs and hands out to the files it packs, so workers
+     * going through many small files don't take the allocation lock for each of them, and the files of one worker
+     * stay next to each other. Slabs double from kFirstSlabBlocks up to kSlabSize, so what is left over (and goes
+     * back to the archive on destruction, as a hole if more was reserved after it) is never more than was used
+     */
+    class BlockSlab {
+    public:
+        explicit BlockSlab(Archive &anArchive);
+        ~BlockSlab();
+        // aCount blocks in address order, cut from the slab; a slab's worth or more comes straight from the archive
+        std::vector<Extent> take(size_t aCount);
+        // blocks that were taken but not used
+        void giveBack(const std::vector<Extent> &anExtents);
+
+    protected:
+        Archive &archive;
+        size_t slabBlocks; // size of the next slab
+        size_t maxSlabBlocks;
+        std::vector<Extent> extents; // ascending and not touching each other
+        size_t freeCount;
     };
 
+    /* Packs a byte stream into a chain of blocks of anArchive. Blocks come from a reservation sized for the expected
+     * length (from aSlab, if given), so a file still lands in one contiguous run when possible, and more are reserved
+     * if the stream runs past it; finish() hands unused blocks back. A block is only written once the block after it is known, since its
+     * header links to it. A file's stream starts with writeName(), which is left out of the entry's storedSize.
+     * Finished blocks are gathered while their positions are consecutive and go to the archive as one write of up to
+     * kWriteCombineSize, so nothing is on disk before finish() unless the run broke off or filled the buffer. Those
+     * writes are queued on the archive's IOBackend, and the next run is gathered in a second buffer meanwhile
+     */
+    class BlockWriter {
+    public:
+        BlockWriter(Archive &anArchive, const Header &aTemplate, size_t anExpectedBlocks, BlockSlab* aSlab=nullptr);
+        // writes into blocks the caller already reserved, and only reserves more if they run out
+        BlockWriter(Archive &anArchive, const Header &aTemplate, const std::vector<Extent> &aReserved);
+        ArchiveStatus<bool> write(const char *aData, size_t aLength);
+        // the name length and name heading a file's stream; written before anything else
+        ArchiveStatus<bool> writeName(std::string_view aName);
+        // writes the last block and whatever is still buffered, and returns the entry describing all of it
+        ArchiveStatus<TOCEntry> finish();
+        // gives every block back, e.g. when the source could not be read; buffered blocks are dropped
+        void abort();
+
+    protected:
+        std::vector<Extent> reserve(size_t aCount);
+        void unreserve(const std::vector<Extent> &anExtents);
+        size_t takeNextPosition();
+        // makes aPos the block being filled, writing out the buffered run first if aPos doesn't continue it
+        ArchiveStatus<bool> startPending(size_t aPos);
+        // completes the header of the block being filled, linking it to aNextPos
+        ArchiveStatus<bool> writePending(size_t aNextPos);
+        // queues the finished blocks and switches to the spare buffer once the write before is done
+        ArchiveStatus<bool> flushBuffer();
+
+        Archive &archive;
+        BlockSlab* slab;
+        Header blockTemplate;
+        size_t blockSize;
+        AlignedBuffer buffer; // the finished blocks of the run, then the one being filled
+        AlignedBuffer spareBuffer; // the previous run, possibly still being written
+        size_t bufferStart; // position of the first block in buffer
+        size_t bufferBlocks; // finished blocks in buffer
+        size_t maxBufferBlocks;
+        size_t pendingPos;
+        size_t fill;
+        std::vector<Extent> reserved; // reserved but not used yet, front first
+        size_t reservedIndex;
+        TOCEntry entry;
+        std::unique_ptr<IOBatch> writes; // declared after the buffers, so it waits for them before they are freed
+    };
+
+    /* One direction of a processor as an incremental transform: input is pushed in chunks and whatever output is
+     * ready is appended to anOutput, so add() and extract() can run it block by block without temp files
+     */
+    class IDataStream {
+    public:
+        // isLast flushes everything still buffered inside the transform
+        virtual ArchiveStatus<bool> push(const char *aData, size_t aLength, bool isLast, std::string &anOutput) = 0;
+        // where the output so far can be entered by IDataProcessor::makeSeekStream (forward streams only)
+        virtual std::vector<SeekPoint> getSeekPoints() const { return {}; }
+        // undoes side effects of what was pushed so far, for a file that could not be added after all
+        virtual void abort() {}
+        virtual ~IDataStream(){};
+    };
+
+    // the factories may be called from several threads at once (see Archive::addMany); each stream has one user
     class IDataProcessor {
     public:
-        virtual ArchiveStatus<bool> process(const std::string &aFilename) = 0;
-        virtual ArchiveStatus<bool> reverseProcess(const std::string &aFilename) = 0;
+        virtual std::unique_ptr<IDataStream> makeProcessStream() = 0;
+        virtual std::unique_ptr<IDataStream> makeReverseStream() = 0;
+        // a reverse stream that starts at one of the seek points of the stored data; nullptr if there are none
+        virtual std::unique_ptr<IDataStream> makeSeekStream() { return nullptr; }
+        // expected output size for aRawSize bytes of input, which sizes the block reservation of the output
+        virtual size_t estimateStoredSize(size_t aRawSize) const { return aRawSize; }
+        // tag stored in header.processorType (at most kProcessorTypeNameSize - 1 chars) so extract can undo it
+        virtual const char* getTypeName() const = 0;
         virtual ~IDataProcessor(){};
     };
 
-    /** This is new child class of data processor, use it to compress the if add asks for it*/
-    class Compression : public IDataProcessor {
+    /* zlib deflate as a streaming transform. The stream is fully flushed every kSeekPointInterval bytes of input,
+     * which resets its history, so inflating can start at any of those points without what came before
+     */
+    class DeflateStream : public IDataStream {
     public:
-        ArchiveStatus<bool> process(const std::string &aFilename) override {
-            int ret, flush;
-            unsigned have;
-            z_stream strm;
+        DeflateStream() : rawOffset(0), storedOffset(0) {
             strm.zalloc = Z_NULL;
             strm.zfree = Z_NULL;
             strm.opaque = Z_NULL;
-            ret = deflateInit(&strm, Z_DEFAULT_COMPRESSION);
-            if (ret != Z_OK){
-                std::cerr << "deflateInit failed\n";
-                return ArchiveStatus<bool>(false);
-            }
-            auto CHUNK = kBlockSize - headerSize;
-            unsigned char in[CHUNK];
-            unsigned char out[CHUNK];
-            std::string destFilePath{aFilename};
-            destFilePath.insert(aFilename.length()-4,"_processed");
-            FILE *source = fopen(aFilename.c_str(), "rb"); // open in read mode
-            FILE *dest = fopen( destFilePath.c_str(),"wb");
-            auto theErr = strerror(errno);
-            do {
-                strm.avail_in = fread(in, 1, CHUNK, source);
-                if (ferror(source)) {
-                    (void)deflateEnd(&strm);
-                    return ArchiveStatus<bool>(false);
-                }
-                flush = feof(source) ? Z_FINISH : Z_NO_FLUSH;
-                strm.next_in = in;
-
-                do{
-                    strm.avail_out = CHUNK;
-                    strm.next_out = out;
-                    ret = deflate(&strm, flush);
-                    have = CHUNK - strm.avail_out;
-                    if (fwrite(out, 1, have, dest) != have || ferror(dest)) {
-                        (void)deflateEnd(&strm);
-                        return ArchiveStatus<bool>(false);
-                    }
-                } while (strm.avail_out == 0);
-            } while (flush != Z_FINISH);
-            (void)deflateEnd(&strm);
-            fclose(dest);
-            fclose(source);
+            isReady = deflateInit(&strm, Z_DEFAULT_COMPRESSION) == Z_OK;
+        }
 
+        ArchiveStatus<bool> push(const char *aData, size_t aLength, bool isLast, std::string &anOutput) override {
+            if(!isReady){ return ArchiveStatus<bool>(ArchiveErrors::badProcessor); }
+            do{
+                size_t thePart = std::min(aLength, kSeekPointInterval - rawOffset % kSeekPointInterval);
+                rawOffset += thePart;
+                bool isFinal = isLast && thePart == aLength;
+                bool isSeekPoint = !isFinal && thePart && rawOffset % kSeekPointInterval == 0;
+                if(!deflateInto(aData, thePart, isFinal ? Z_FINISH : isSeekPoint ? Z_FULL_FLUSH : Z_NO_FLUSH, anOutput)){
+                    return ArchiveStatus<bool>(ArchiveErrors::badProcessor);
+                }
+                if(isSeekPoint){ seekPoints.push_back(SeekPoint{rawOffset, storedOffset}); }
+                aData += thePart;
+                aLength -= thePart;
+            } while(aLength);
             return ArchiveStatus<bool>(true);
         }
 
-        // takes in the filepath of the file with compressed data and creates a new file with uncompressed data
-        ArchiveStatus<bool> reverseProcess(const std::string &aFilename) override {
+        std::vector<SeekPoint> getSeekPoints() const override { return seekPoints; }
+
+        ~DeflateStream() override { if(isReady){ (void)deflateEnd(&strm); } }
+
+    protected:
+        bool deflateInto(const char *aData, size_t aLength, int aFlush, std::string &anOutput) {
+            strm.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(aData));
+            strm.avail_in = aLength;
             int ret;
-            unsigned have;
-            z_stream strm;
-            auto CHUNK = kBlockSize - headerSize;
-            unsigned char in[CHUNK];
-            unsigned char out[CHUNK];
-            std::string sourceFilePath{aFilename};
-            sourceFilePath.insert(aFilename.length()-4,"_reverse_process");
-            FILE *source = fopen(sourceFilePath.c_str(), "rb"); // open in read mode
-            FILE *dest = fopen( aFilename.c_str(),"wb");
+            do{
+                // deflate straight into the tail of anOutput
+                size_t theOldSize = anOutput.size();
+                size_t theChunk = std::max<size_t>(deflateBound(&strm, strm.avail_in), 1024);
+                anOutput.resize(theOldSize + theChunk);
+                strm.next_out = reinterpret_cast<Bytef*>(&anOutput[theOldSize]);
+                strm.avail_out = theChunk;
+                ret = deflate(&strm, aFlush);
+                anOutput.resize(theOldSize + theChunk - strm.avail_out);
+                storedOffset += theChunk - strm.avail_out;
+                if(ret == Z_STREAM_ERROR){ return false; }
+            } while(strm.avail_out == 0 || (aFlush == Z_FINISH && ret != Z_STREAM_END));
+            return true;
+        }
+
+        z_stream strm;
+        bool isReady;
+        uint64_t rawOffset;
+        uint64_t storedOffset;
+        std::vector<SeekPoint> seekPoints;
+    };
+
+    // zlib inflate as a streaming transform; isRaw reads headerless deflate data, i.e. data entered at a seek point
+    class InflateStream : public IDataStream {
+    public:
+        explicit InflateStream(bool isRaw=false) : isDone(false) {
             strm.zalloc = Z_NULL;
             strm.zfree = Z_NULL;
             strm.opaque = Z_NULL;
             strm.avail_in = 0;
             strm.next_in = Z_NULL;
-            ret = inflateInit(&strm);
-            if (ret != Z_OK){return ArchiveStatus<bool>(false);}
-            do {
-                strm.avail_in = fread(in, 1, CHUNK, source);
-                if (ferror(source)) {
-                    (void)inflateEnd(&strm);
-                    return ArchiveStatus<bool>(false);;
-                }
-                if (strm.avail_in == 0)
-                    break;
-                strm.next_in = in;
-
-                do{
-                    strm.avail_out = CHUNK;
-                    strm.next_out = out;
-                    ret = inflate(&strm, Z_NO_FLUSH);
-                    switch (ret) {
-                        case Z_NEED_DICT:
-                            ret = Z_DATA_ERROR;     /* and fall through */
-                        case Z_DATA_ERROR:
-                        case Z_MEM_ERROR:
-                            (void)inflateEnd(&strm);
-                            return ArchiveStatus<bool>(false);;
-                    }
-                    have = CHUNK - strm.avail_out;
-                    if (fwrite(out, 1, have, dest) != have || ferror(dest)) {
-                        (void)inflateEnd(&strm);
-                        return ArchiveStatus<bool>(false);;
-                    }
-                } while (strm.avail_out == 0);
-            } while (ret != Z_STREAM_END);
-            (void)inflateEnd(&strm);
-            fclose(source);
-            fclose(dest);
+            isReady = (isRaw ? inflateInit2(&strm, -MAX_WBITS) : inflateInit(&strm)) == Z_OK;
+        }
 
+        ArchiveStatus<bool> push(const char *aData, size_t aLength, bool isLast, std::string &anOutput) override {
+            if(!isReady){ return ArchiveStatus<bool>(ArchiveErrors::badProcessor); }
+            strm.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(aData));
+            strm.avail_in = aLength;
+            bool isOutputFull = true; // run at least once so output held back by an earlier call is drained
+            while(!isDone && (strm.avail_in || isOutputFull)){
+                size_t theOldSize = anOutput.size();
+                size_t theChunk = std::max<size_t>(aLength * 4, 16384);
+                anOutput.resize(theOldSize + theChunk);
+                strm.next_out = reinterpret_cast<Bytef*>(&anOutput[theOldSize]);
+                strm.avail_out = theChunk;
+                int ret = inflate(&strm, Z_NO_FLUSH);
+                isOutputFull = strm.avail_out == 0;
+                anOutput.resize(theOldSize + theChunk - strm.avail_out);
+                if(ret == Z_STREAM_END){ isDone = true; }
+                else if(ret == Z_BUF_ERROR){ break; } // no progress possible until more input arrives
+                else if(ret != Z_OK){ return ArchiveStatus<bool>(ArchiveErrors::badData); }
+            }
+            if(isLast && !isDone){ return ArchiveStatus<bool>(ArchiveErrors::badData); } // truncated stream
             return ArchiveStatus<bool>(true);
         }
 
+        ~InflateStream() override { if(isReady){ (void)inflateEnd(&strm); } }
+
+    protected:
+        z_stream strm;
+        bool isReady;
+        bool isDone;
+    };
+
+    /* zlib deflate split across threads (the pigz scheme): input is cut into chunks that are raw-deflated
+     * concurrently, each primed with the last kDeflateWindowSize bytes before it so matches still reach back across
+     * chunk borders. Every chunk but the last ends on a sync flush, so the pieces concatenate into a single zlib
+     * stream (header and adler32 trailer added here) that InflateStream reads like any other.
+     * The workers are started with the first chunk and stay for the life of the stream. push() hands each chunk to
+     * them as soon as it is cut and takes the output of finished ones in order, so cutting goes on while earlier chunks
+     * are deflated; it only waits once 2 * threadCount chunks are in flight
+     */
+    class ParallelDeflateStream : public IDataStream {
+    public:
+        ParallelDeflateStream(size_t aThreadCount, size_t aChunkSize);
+        ArchiveStatus<bool> push(const char *aData, size_t aLength, bool isLast, std::string &anOutput) override;
+        std::vector<SeekPoint> getSeekPoints() const override { return seekPoints; }
+        ~ParallelDeflateStream() override;
+
+    protected:
+        struct Job{
+            std::string input; // the priming dictionary, then the chunk
+            size_t dictionaryLength;
+            size_t rawLength; // of the chunk
+            bool isFinal; // closes the deflate stream
+            std::string output;
+            uLong checksum; // adler32 of the chunk alone
+            bool isOK = false;
+            bool isDone = false;
+        };
+
+        // cuts the next aLength bytes of input into a job and queues it; the last job of the stream is aFinal
+        void queueChunk(const char *aData, size_t aLength, bool isFinal);
+        static void deflateJob(Job &aJob);
+        // appends the output of finished jobs in order; waits for all of them if isWaiting, else only while too many run
+        ArchiveStatus<bool> collect(std::string &anOutput, bool isWaiting);
+        void runWorker();
+
+        size_t threadCount;
+        size_t chunkSize;
+        std::string pending; // input waiting to fill a chunk
+        std::string history; // the input right before pending, up to kDeflateWindowSize bytes
+        uLong checksum;
+        bool hasHeader;
+        size_t chunksPerSeekPoint; // every that many chunks one is deflated without priming, making it a seek point
+        size_t chunksQueued;
+        size_t chunkCount; // chunks whose output was taken
+        uint64_t rawOffset;
+        uint64_t storedOffset;
+        std::vector<SeekPoint> seekPoints;
+        std::deque<std::unique_ptr<Job>> jobs; // in stream order, until their output is taken
+        std::deque<Job*> queue; // jobs no worker has picked up yet
+        std::vector<std::thread> workers;
+        std::mutex jobMutex; // guards queue, the isOK/isDone flags and isStopping
+        std::condition_variable jobQueued;
+        std::condition_variable jobDone;
+        bool isStopping;
+    };
+
+    /** This is new child class of data processor, use it to compress the if add asks for it*/
+    class Compression : public IDataProcessor {
+    public:
+        // aThreadCount > 1 opts into ParallelDeflateStream; either way extract reads the result with InflateStream
+        explicit Compression(size_t aThreadCount=1, size_t aChunkSize=kDeflateChunkSize)
+            : threadCount(aThreadCount), chunkSize(aChunkSize) {}
+
+        std::unique_ptr<IDataStream> makeProcessStream() override {
+            if(threadCount > 1){ return std::make_unique<ParallelDeflateStream>(threadCount, chunkSize); }
+            return std::make_unique<DeflateStream>();
+        }
+
+        std::unique_ptr<IDataStream> makeReverseStream() override {
+            return std::make_unique<InflateStream>();
+        }
+
+        std::unique_ptr<IDataStream> makeSeekStream() override {
+            return std::make_unique<InflateStream>(true);
+        }
+
+        const char* getTypeName() const override { return "comp"; }
+
         ~Compression() override = default;
+
+    protected:
+        size_t threadCount;
+        size_t chunkSize;
+    };
+
+    /* Forward half of deduplication: cuts the input at content-defined boundaries (a gear rolling hash, so an edit
+     * only moves the boundaries next to it), stores each chunk not yet in the archive's chunk index, and outputs the
+     * file's recipe, one kRecipeRecordSize record per chunk. Every kSeekPointInterval of input a record boundary is
+     * reported as a seek point
+     */
+    class ChunkingStream : public IDataStream {
+    public:
+        explicit ChunkingStream(Archive &anArchive);
+        ArchiveStatus<bool> push(const char *aData, size_t aLength, bool isLast, std::string &anOutput) override;
+        std::vector<SeekPoint> getSeekPoints() const override { return seekPoints; }
+        // drops the chunk references taken so far
+        void abort() override;
+
+    protected:
+        // length of the chunk starting at aData, 0 if aLength could still grow into a longer one
+        size_t findBoundary(const char *aData, size_t aLength, bool isLast) const;
+
+        Archive &archive;
+        std::string pending; // input after the last chunk boundary
+        uint64_t rawOffset;
+        uint64_t storedOffset;
+        uint64_t nextSeekPoint;
+        std::vector<SeekPoint> seekPoints;
+        std::vector<std::string> references; // digests of every chunk in the recipe so far
+    };
+
+    // reverse half of deduplication: turns recipe records back into the chunks they name
+    class RecipeStream : public IDataStream {
+    public:
+        explicit RecipeStream(Archive &anArchive) : archive(anArchive) {}
+        ArchiveStatus<bool> push(const char *aData, size_t aLength, bool isLast, std::string &anOutput) override;
+
+    protected:
+        Archive &archive;
+        std::string pending; // a record split across blocks
+    };
+
+    /* Stores files as recipes of shared, reference-counted chunks, so data that several files (or one file) have in
+     * common is stored once. Chunks live in anArchive, so a Deduplication is bound to the archive it is used with
+     */
+    class Deduplication : public IDataProcessor {
+    public:
+        explicit Deduplication(Archive &anArchive) : archive(anArchive) {}
+
+        std::unique_ptr<IDataStream> makeProcessStream() override {
+            return std::make_unique<ChunkingStream>(archive);
+        }
+
+        std::unique_ptr<IDataStream> makeReverseStream() override {
+            return std::make_unique<RecipeStream>(archive);
+        }
+
+        // records are self-contained, so any record boundary is a place to start
+        std::unique_ptr<IDataStream> makeSeekStream() override {
+            return std::make_unique<RecipeStream>(archive);
+        }
+
+        // one record per average-sized chunk
+        size_t estimateStoredSize(size_t aRawSize) const override {
+            return aRawSize / (kMinChunkSize + (size_t(1) << kChunkMaskBits)) * kRecipeRecordSize;
+        }
+
+        const char* getTypeName() const override { return "dedp"; }
+
+    protected:
+        Archive &archive;
     };
 
     class Archive {
     protected:
         std::vector<std::shared_ptr<IDataProcessor>> processors; // keep this in mind when designing interface
         std::vector<std::shared_ptr<ArchiveObserver>> observers; // all of these need to be notified when any action is taken
-        Archive(const std::string &aFullPath, AccessMode aMode);  //protected on purpose
+        Archive(const std::string &aFullPath, AccessMode aMode, size_t aBlockSize=kBlockSize);  //protected on purpose
 
     public:
 
         ~Archive();
 
-        static    ArchiveStatus<std::shared_ptr<Archive>> createArchive(const std::string &anArchiveName);
+        static    ArchiveStatus<std::shared_ptr<Archive>> createArchive(const std::string &anArchiveName,
+                                                                        size_t aBlockSize=kBlockSize);
         static    ArchiveStatus<std::shared_ptr<Archive>> openArchive(const std::string &anArchiveName);
 
         Archive&  addObserver(std::shared_ptr<ArchiveObserver> anObserver);
         void notifyObservers(ActionType anAction, const std::string &aName, bool status);
 
         ArchiveStatus<bool>      add(const std::string &aFilename, IDataProcessor* aProcessor=nullptr);
+        /* adds a batch of files; aThreadCount workers (0 = one per core) read, process and write them concurrently
+         * with positional writes, and the TOC is updated once they are done. Returns how many files were added
+         */
+        ArchiveStatus<size_t>    addMany(const std::vector<std::string> &aPaths, IDataProcessor* aProcessor=nullptr,
+                                         size_t aThreadCount=0);
         ArchiveStatus<bool>      extract(const std::string &aFilename, const std::string &aFullPath);
+        /* copies up to aLength bytes of the file starting at anOffset into aBuffer and returns how many were copied
+         * (fewer at the end of the file). Only the blocks holding the range are read; processed files are undone from
+         * the closest seek point before anOffset
+         */
+        ArchiveStatus<size_t>    readRange(const std::string &aFilename, size_t anOffset, size_t aLength, char *aBuffer);
         ArchiveStatus<bool>      remove(const std::string &aFilename);
 
+        // rewrites the archive with a new block size (a power of two between kSmallestBlockSize and kLargestBlockSize)
         ArchiveStatus<bool>      resize(size_t aBlockSize); // New!
+        /* appends the live blocks of another archive with the same block size as they are stored (no reprocessing),
+         * renumbering their links and adding its files and chunks to the index. Fails with fileExists before anything
+         * is written if a file name is in both archives
+         */
         ArchiveStatus<bool>      merge(const std::string &anArchiveName); // New!
-        ArchiveStatus<bool>      addFolder(const std::string &aFolder); // New!
-        ArchiveStatus<bool>      extractFolder(const std::string &aFolderName, const std::string &anExtractPath); // New!
+        /* adds every regular file below aFolder under its path, skipping names already in the archive. Workers walk
+         * the tree together, the files are sorted by folder and type and (unless processed) streamed into one region
+         * appended for the whole batch, and the TOC is updated once at the end. Fails with the first error of any
+         * file (the others are still added)
+         */
+        ArchiveStatus<bool>      addFolder(const std::string &aFolder, IDataProcessor* aProcessor=nullptr,
+                                           size_t aThreadCount=0); // New!
+        /* extracts every file whose name lies under aFolderName into the same layout below anExtractPath. Files are
+         * taken in the order of their first block, so reads sweep the archive front to back, and written by
+         * aThreadCount workers (0 = one per core), each output preallocated when its size is known up front
+         */
+        ArchiveStatus<bool>      extractFolder(const std::string &aFolderName, const std::string &anExtractPath,
+                                               size_t aThreadCount=0); // New!
 
-        ArchiveStatus<size_t>    list(std::ostream &aStream);
+        /* lists the file names (without their folders), in name order. With aPrefix only the matching names are
+         * listed: a folder ("docs/") lists its files and its subfolders (once each, as "name/"), anything else is a
+         * glob prefix ("docs/re" or "docs/re*"). Relative prefixes are looked up in the archive's folder like
+         * extract() does. Returns the number of lines listed
+         */
+        ArchiveStatus<size_t>    list(std::ostream &aStream, const std::string &aPrefix="");
         ArchiveStatus<size_t>    debugDump(std::ostream &aStream);
 
+        /* slides every live block down over the free ones (file and chunk blocks alike), fixes the chain links and the
+         * index, and shrinks the file; returns the number of blocks left
+         */
         ArchiveStatus<size_t>    compact();
+        /* one bounded round of incremental compaction: moves the blocks at the end of the archive into the lowest free
+         * ones (at most aMaxBlocks of them, for at most aMaxMillis if that is not 0), relinking them and updating their
+         * extents as it goes, then gives up the emptied tail. The archive is consistent after every move. Returns how
+         * many blocks were moved
+         */
+        ArchiveStatus<size_t>    compactStep(size_t aMaxBlocks, size_t aMaxMillis=0);
+        // share of the archive's blocks that are free
+        double getFragmentation() const;
+        /* block checksums are verified on every read unless turned off here, for callers that trust the storage and
+         * want reads at full speed. Blocks are checksummed when written either way
+         */
+        void setChecksumVerification(bool shouldVerify);
+        /* routes the archive's reads and writes outside the mapping (block writes of add(), pool misses, direct mode,
+         * the copies of merge() and compact(), output of extractFolder()) through a backend of aType that keeps up to
+         * aQueueDepth of them in flight; badMode if this system has no such backend or it lacks positional reads and
+         * writes
+         */
+        ArchiveStatus<bool> setIOBackend(IOBackendType aType, size_t aQueueDepth=kIOQueueDepth);
+        /* reads blocks through a buffer pool of about aBytes instead of mapping the archive, for archives much larger
+         * than the memory that should go to them: hot pages (headers, the starts of files) stay cached while scans
+         * cycle through the rest, and header rewrites are gathered until flush(). 0 goes back to the mapping
+         */
+        ArchiveStatus<bool> setBufferPool(size_t aBytes);
+        /* moves the bulk of the archive's I/O (block runs written by add(), pages read by extract() and scans,
+         * compaction copies) past the page cache with O_DIRECT, for streaming archives much larger than the memory of
+         * a shared host. Reads go through the buffer pool, one of kDirectPoolSize being set up if there is none. The
+         * block size has to be a multiple of kDirectIOAlignment (badBlockLength otherwise); badMode if the file
+         * system doesn't support direct I/O
+         */
+        ArchiveStatus<bool> setDirectIO(bool isDirect);
+        /* runs compaction steps on a background thread once fragmentation reaches aThreshold, until no free block is
+         * left. Public operations and steps exclude each other, so steps only run between calls
+         */
+        void startCompactor(double aThreshold=kCompactThreshold, size_t aBlocksPerStep=kCompactStepBlocks,
+                            size_t aPauseMillis=kCompactPauseMillis);
+        void stopCompactor();
         void reconstructTOC();
 
+        // writes the index region and a clean superblock; called on destruction if the archive was modified
+        ArchiveStatus<bool>      flush();
+        size_t getBlockSize() const { return arcBlockHandler.blockSize; }
+
         TOC arcTOC;
         BlockHandler arcBlockHandler;
         std::string arcPath;
-        std::fstream arcFileStream;
         size_t arcNumBlocks;
         std::vector<std::shared_ptr<ArchiveObserver>> arcObservers;
         std::string arcFolder;
+
+    private:
+        // the block plumbing and the deduplication streams work on the archive's internals
+        friend struct BlockHandler;
+        friend class BlockWriter;
+        friend class BlockSlab;
+        friend class ChunkingStream;
+        friend class RecipeStream;
+
+        // loads the TOC, the free-space map and the chunk index from the index region; false if it is missing or stale
+        bool loadIndex(size_t aFileLength);
+        // clears the clean flag on disk and drops the stale index before the first mutation of a session
+        void markDirty();
+        /* reserves aCount blocks: a single free run if one is large enough, otherwise the free blocks in address
+         * order followed by new blocks appended at the end of the archive
+         */
+        std::vector<Extent> allocateExtents(size_t aCount);
+        // frees the blocks and shrinks the archive when they were the last ones in it
+        void releaseExtents(const std::vector<Extent> &anExtents);
+        /* the file or chunk with an extent ending at block anEnd, and that extent's number in it, as far as the owner
+         * index knows; nullptr if it doesn't, and a stale index entry is dropped on the way
+         */
+        TOCEntry* findExtentOwner(size_t anEnd, size_t &anIndex);
+        /* puts the extents of every file and then every chunk into the owner index. An unfinished scan is picked up
+         * where it stopped; false if aDeadline came first (only checked if hasDeadline), true once the scan is done
+         */
+        bool scanExtentOwners(std::chrono::steady_clock::time_point aDeadline, bool hasDeadline);
+        /* streams a file (through aProcessor, if given) into newly reserved blocks and returns its entry without
+         * touching the TOC; block allocation is serialized, so several files can be packed at once
+         */
+        ArchiveStatus<TOCEntry> packFile(const std::string &aFilename, IDataProcessor* aProcessor,
+                                         const Extent &aReserved=Extent{0, 0}, BlockSlab* aSlab=nullptr);
+        /* packs the files on aThreadCount workers (0 = one per core), the i-th into aReserved[i] if given, otherwise
+         * into blocks from a BlockSlab per worker; returns the entries in the order of aNames, empty where a file
+         * could not be packed
+         */
+        std::vector<ArchiveStatus<TOCEntry>> packBatch(const std::vector<std::string> &aNames, IDataProcessor* aProcessor,
+                                                       size_t aThreadCount, const std::vector<Extent> &aReserved={});
+        // reserves aCount new blocks at the end of the archive, leaving the free ones alone
+        Extent appendExtent(size_t aCount);
+        /* one region at the end of the archive for a batch of unprocessed files, cut into a slice per file that fits
+         * its stream exactly; aFileSizes are the sizes of the files named by aNames
+         */
+        std::vector<Extent> appendSlices(const std::vector<std::string> &aNames, const std::vector<size_t> &aFileSizes);
+        /* hands the stored payload of anEntry, from aStoredOffset on, to aVisitor one block at a time until it returns
+         * false. Every block but the last is full, so the starting block is found from the offset alone
+         */
+        ArchiveStatus<bool> visitStored(const TOCEntry &anEntry, uint64_t aStoredOffset,
+                                        const std::function<bool(const char*, size_t)> &aVisitor);
+        /* like visitStored, but the offset counts from the start of the stream, the file name included. Both fail with
+         * badBlockHash at the first block that fails its checksum, before handing it on
+         */
+        ArchiveStatus<bool> visitRaw(const TOCEntry &anEntry, uint64_t aRawOffset,
+                                     const std::function<bool(const char*, size_t)> &aVisitor);
+        /* hands the original contents of anEntry to aWriter piece by piece, undoing its processor on the way; fails
+         * with fileWriteError if aWriter returns false. Safe to run on several threads once the archive is mapped
+         */
+        ArchiveStatus<bool> unpackEntry(const TOCEntry &anEntry, const std::function<bool(const char*, size_t)> &aWriter);
+        /* the digest of a chunk, storing the chunk unless the index already has it; either way its reference count
+         * goes up by one. Safe to call from several threads at once
+         */
+        ArchiveStatus<std::string> storeChunk(const char *aData, size_t aLength);
+        // drops one reference and frees the chunk with the last one
+        void releaseChunk(const std::string &aDigest);
+        // calls aVisitor with the digest of every record in the recipe held by anEntry
+        ArchiveStatus<bool> visitRecipe(const TOCEntry &anEntry, const std::function<void(const std::string&)> &aVisitor);
+        // whether anEntry holds the recipe of a deduplicated file
+        bool isDeduplicated(const TOCEntry &anEntry);
+        // writes empty headers over the blocks (so the recovery scan sees them as free) and releases them
+        void clearBlocks(const std::vector<Extent> &anExtents);
+
+        FreeSpaceMap arcFreeSpace;
+        ArchiveFile arcFile;
+        Superblock arcSuperblock;
+        bool arcIsDirty;
+        mutable std::mutex arcAllocationMutex; // guards arcFreeSpace and arcNumBlocks while addMany workers run
+        ChunkIndex arcChunks;
+        std::mutex arcChunkMutex; // guards arcChunks and arcPendingChunks while addMany workers deduplicate
+        std::set<std::string> arcPendingChunks; // digests of chunks being written by storeChunk()
+        std::condition_variable arcChunkSignal; // a pending chunk was stored or given up
+        std::recursive_mutex arcOperationMutex; // held by public operations and by compaction steps
+        std::thread arcCompactor;
+        std::mutex arcCompactorMutex;
+        std::condition_variable arcCompactorSignal;
+        bool arcCompactorStop;
+        std::atomic<uint32_t> arcNextNameId; // the nameId of the next file added; persisted with the index
+        size_t arcPoolBytes; // memory given to the buffer pool, 0 while the archive is mapped instead
+        struct ExtentOwner {
+            bool isChunk;
+            std::string key; // the file name, or the chunk digest
+        };
+        // extent end -> owner, for compactStep(); entries may be stale and are checked before use
+        std::map<size_t, ExtentOwner> arcExtentOwners;
+        struct OwnerScan {
+            size_t file = 0; // next TOC entry to scan
+            bool isInChunks = false;
+            std::string chunk; // last chunk digest scanned
+        } arcOwnerScan; // where an unfinished scanExtentOwners() goes on
     };
 
 }
@@ -0,0 +1,245 @@
+//
+//  ArchiveFile.cpp
+//
+
+#include "ArchiveFile.hpp"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <cstring>
+#include <algorithm>
+#include <vector>
+
+namespace ECE141 {
+
+    ArchiveFile::ArchiveFile() : fd(-1), directFd(-1), shouldBeDirect(false), mapData(nullptr), mapLength(0),
+                                 backend(IOBackend::create(IOBackendType::synchronous)), poolBase(0) {}
+
+    ArchiveFile::~ArchiveFile(){
+        close();
+    }
+
+    bool ArchiveFile::open(const std::string &aPath, bool shouldTruncate){
+        close();
+        int theFlags = O_RDWR | O_CLOEXEC;
+        if(shouldTruncate){ theFlags |= O_CREAT | O_TRUNC; }
+        fd = ::open(aPath.c_str(), theFlags, 0644);
+        path = aPath;
+        return fd >= 0 && (!shouldBeDirect || openDirect());
+    }
+
+    void ArchiveFile::close(){
+        if(pool){
+            pool->flush();
+            pool->drop();
+        }
+        unmap();
+        if(directFd >= 0){
+            ::close(directFd);
+            directFd = -1;
+        }
+        if(fd >= 0){
+            ::close(fd);
+            fd = -1;
+        }
+    }
+
+    bool ArchiveFile::openDirect(){
+#ifdef O_DIRECT
+        if(directFd < 0){ directFd = ::open(path.c_str(), O_RDWR | O_DIRECT | O_CLOEXEC); }
+#endif
+        return directFd >= 0;
+    }
+
+    bool ArchiveFile::setDirect(bool isDirect){
+        if(isDirect){
+            // a mapping would pull the whole archive through the page cache again
+            unmap();
+            if(fd >= 0 && !openDirect()){ return false; }
+        }
+        else if(directFd >= 0){
+            ::close(directFd);
+            directFd = -1;
+        }
+        shouldBeDirect = isDirect;
+        return true;
+    }
+
+    int ArchiveFile::getFd(const char *aBuffer, size_t aLength, size_t anOffset) const{
+        bool isAligned = !(reinterpret_cast<uintptr_t>(aBuffer) % kDirectIOAlignment) &&
+                         !(aLength % kDirectIOAlignment) && !(anOffset % kDirectIOAlignment);
+        return directFd >= 0 && isAligned ? directFd : fd;
+    }
+
+    bool ArchiveFile::readAt(char *aBuffer, size_t aLength, size_t anOffset) const{
+        if(pool){
+            auto [theFirst, theLast] = getPoolPages(anOffset, aLength);
+            if(theFirst < theLast && !pool->flush(theFirst, theLast)){ return false; }
+        }
+        return transferAt(false, aBuffer, aLength, anOffset);
+    }
+
+    bool ArchiveFile::writeAt(const char *aBuffer, size_t aLength, size_t anOffset){
+        updatePool(aBuffer, aLength, anOffset);
+        return transferAt(true, const_cast<char*>(aBuffer), aLength, anOffset);
+    }
+
+    bool ArchiveFile::transferAt(bool isWrite, char *aBuffer, size_t aLength, size_t anOffset) const{
+        IOBatch theBatch(*backend);
+        if(aLength <= kIOPieceSize){
+            theBatch.submit(IORequest{isWrite, getFd(aBuffer, aLength, anOffset), aBuffer, aLength, anOffset});
+            return theBatch.wait();
+        }
+        std::vector<IORequest> theRequests;
+        theRequests.reserve((aLength + kIOPieceSize - 1) / kIOPieceSize);
+        for(size_t theDone=0; theDone<aLength; theDone+=kIOPieceSize){
+            size_t thePiece = std::min(kIOPieceSize, aLength - theDone);
+            theRequests.push_back(IORequest{isWrite, getFd(aBuffer + theDone, thePiece, anOffset + theDone),
+                                            aBuffer + theDone, thePiece, anOffset + theDone});
+        }
+        theBatch.submit(theRequests.data(), theRequests.size());
+        return theBatch.wait();
+    }
+
+    bool ArchiveFile::writeAt(const struct iovec *aVectors, int aCount, size_t anOffset){
+        size_t theTotal = 0;
+        for(int i=0; i<aCount; i++){
+            updatePool(static_cast<const char*>(aVectors[i].iov_base), aVectors[i].iov_len, anOffset + theTotal);
+            theTotal += aVectors[i].iov_len;
+        }
+        ssize_t theCount = ::pwritev(fd, aVectors, aCount, anOffset);
+        if(theCount == static_cast<ssize_t>(theTotal)){ return true; }
+        if(theCount < 0){ return false; }
+        // short vectored write: finish the remainder piece by piece
+        size_t theDone = theCount;
+        for(int i=0; i<aCount; i++){
+            size_t theLength = aVectors[i].iov_len;
+            if(theDone >= theLength){
+                theDone -= theLength;
+                continue;
+            }
+            const char* theBase = static_cast<const char*>(aVectors[i].iov_base);
+            if(!writeAt(theBase + theDone, theLength - theDone, anOffset + theCount)){ return false; } // updates again, harmlessly
+            theCount += theLength - theDone;
+            theDone = 0;
+        }
+        return true;
+    }
+
+    void ArchiveFile::writeAt(const char *aBuffer, size_t aLength, size_t anOffset, IOBatch &aBatch){
+        updatePool(aBuffer, aLength, anOffset);
+        aBatch.submit(IORequest{true, getFd(aBuffer, aLength, anOffset), const_cast<char*>(aBuffer), aLength, anOffset});
+    }
+
+    size_t ArchiveFile::getSize() const{
+        struct stat theStat;
+        if(fd < 0 || ::fstat(fd, &theStat) != 0){ return 0; }
+        return theStat.st_size;
+    }
+
+    bool ArchiveFile::truncate(size_t aLength){
+        // pages past the new end would fault if touched, so drop the mapping and let the next view remap
+        if(aLength < mapLength){ unmap(); }
+        if(pool){
+            // what is pending below the new end must reach the file; the page holding the end is read again later
+            if(!pool->flush()){ return false; }
+            pool->drop(aLength > poolBase ? (aLength - poolBase) / pool->getPageSize() : 0);
+        }
+        return ::ftruncate(fd, aLength) == 0;
+    }
+
+    const char* ArchiveFile::getView(size_t anOffset, size_t aLength){
+        if(fd < 0 || pool || shouldBeDirect){ return nullptr; }
+        if(anOffset + aLength > mapLength){
+            size_t theSize = getSize();
+            if(anOffset + aLength > theSize){ return nullptr; }
+            void* theData = MAP_FAILED;
+#ifdef __linux__
+            if(mapData){ theData = ::mremap(mapData, mapLength, theSize, MREMAP_MAYMOVE); }
+            else{ theData = ::mmap(nullptr, theSize, PROT_READ, MAP_SHARED, fd, 0); }
+#else
+            unmap();
+            theData = ::mmap(nullptr, theSize, PROT_READ, MAP_SHARED, fd, 0);
+#endif
+            if(theData == MAP_FAILED){
+                unmap();
+                return nullptr;
+            }
+            mapData = static_cast<char*>(theData);
+            mapLength = theSize;
+        }
+        return mapData + anOffset;
+    }
+
+    void ArchiveFile::unmap(){
+        if(mapData){ ::munmap(mapData, mapLength); }
+        mapData = nullptr;
+        mapLength = 0;
+    }
+
+    bool ArchiveFile::setPool(size_t aBase, size_t aPageSize, size_t aFrameCount){
+        if(!flushPool()){ return false; }
+        pool.reset();
+        if(!aFrameCount){ return true; }
+        unmap();
+        poolBase = aBase;
+        auto loadPage = [this](size_t aPage, char* aFrame){
+            // the last page may run past the end of the file; the rest of it reads as zeros
+            size_t theOffset = poolBase + aPage * pool->getPageSize();
+            size_t theSize = getSize();
+            size_t theLength = theSize > theOffset ? std::min(pool->getPageSize(), theSize - theOffset) : 0;
+            if(theLength && !transferAt(false, aFrame, theLength, theOffset)){ return false; }
+            std::memset(aFrame + theLength, 0, pool->getPageSize() - theLength);
+            return true;
+        };
+        auto storePage = [this](size_t aPage, size_t anOffset, const char* aData, size_t aLength){
+            size_t thePageOffset = poolBase + aPage * pool->getPageSize();
+            if(directFd >= 0){
+                // the frame holds the whole page, so the span can grow to aligned bounds, unless that runs past the
+                // end of the file, which it would extend
+                size_t theBegin = anOffset / kDirectIOAlignment * kDirectIOAlignment;
+                size_t theEnd = (anOffset + aLength + kDirectIOAlignment - 1) / kDirectIOAlignment * kDirectIOAlignment;
+                if(thePageOffset + theEnd <= getSize()){
+                    aData -= anOffset - theBegin;
+                    anOffset = theBegin;
+                    aLength = theEnd - theBegin;
+                }
+            }
+            return transferAt(true, const_cast<char*>(aData), aLength, thePageOffset + anOffset);
+        };
+        pool = std::make_unique<BufferPool>(aPageSize, aFrameCount, loadPage, storePage);
+        return true;
+    }
+
+    bool ArchiveFile::flushPool(){
+        return !pool || pool->flush();
+    }
+
+    std::pair<size_t, size_t> ArchiveFile::getPoolPages(size_t anOffset, size_t aLength) const{
+        size_t theEnd = anOffset + aLength;
+        if(!pool || theEnd <= poolBase){ return {0, 0}; }
+        size_t theStart = std::max(anOffset, poolBase) - poolBase;
+        return {theStart / pool->getPageSize(), (theEnd - poolBase + pool->getPageSize() - 1) / pool->getPageSize()};
+    }
+
+    void ArchiveFile::updatePool(const char *aBuffer, size_t aLength, size_t anOffset){
+        if(!pool || anOffset + aLength <= poolBase){ return; }
+        if(anOffset < poolBase){
+            aBuffer += poolBase - anOffset;
+            aLength -= poolBase - anOffset;
+            anOffset = poolBase;
+        }
+        size_t thePageSize = pool->getPageSize();
+        while(aLength){
+            size_t thePage = (anOffset - poolBase) / thePageSize;
+            size_t theInPage = (anOffset - poolBase) % thePageSize;
+            size_t theChunk = std::min(aLength, thePageSize - theInPage);
+            pool->update(thePage, theInPage, aBuffer, theChunk);
+            aBuffer += theChunk;
+            aLength -= theChunk;
+            anOffset += theChunk;
+        }
+    }
+
+}
@@ -0,0 +1,99 @@
+//
+//  ArchiveFile.hpp
+//
+
+#ifndef ArchiveFile_hpp
+#define ArchiveFile_hpp
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <sys/uio.h>
+#include "IOBackend.hpp"
+#include "BufferPool.hpp"
+
+namespace ECE141 {
+
+    /* Owns the descriptor of an archive file. All I/O is positional (pread/pwrite), so there is no shared stream
+     * position, and reads can be served from a read-only shared mapping of the file. Writes go through the same
+     * page cache as the mapping, so mapped views always see them. Every read and write outside the mapping goes
+     * through an IOBackend, synchronous unless another one is set; large ones are split into kIOPieceSize pieces
+     * that are queued together.
+     * With a BufferPool the file is not mapped; pages past a base offset are cached in the pool instead. Every read,
+     * write and truncation here keeps the pool coherent: reads see its pending changes, writes update resident pages.
+     * In direct mode the file is never mapped, and every transfer whose buffer, offset and length are aligned to
+     * kDirectIOAlignment bypasses the page cache through a second, O_DIRECT descriptor; the rest (the index, single
+     * headers, the tail of the file) stays buffered
+     */
+    class ArchiveFile {
+    public:
+        ArchiveFile();
+        ~ArchiveFile();
+        ArchiveFile(const ArchiveFile&) = delete;
+        ArchiveFile& operator=(const ArchiveFile&) = delete;
+
+        bool open(const std::string &aPath, bool shouldTruncate);
+        void close();
+        bool isOpen() const { return fd >= 0; }
+
+        // both return false on a short transfer
+        bool readAt(char *aBuffer, size_t aLength, size_t anOffset) const;
+        bool writeAt(const char *aBuffer, size_t aLength, size_t anOffset);
+        bool writeAt(const struct iovec *aVectors, int aCount, size_t anOffset);
+        // queues the write in aBatch; aBuffer has to stay untouched until aBatch.wait() returned
+        void writeAt(const char *aBuffer, size_t aLength, size_t anOffset, IOBatch &aBatch);
+
+        /* opens or closes the O_DIRECT descriptor; kept across reopening the file. False if the system or the file
+         * system doesn't support direct I/O
+         */
+        bool setDirect(bool isDirect);
+        bool isDirect() const { return shouldBeDirect; }
+
+        IOBackend& getBackend() { return *backend; }
+        // only while no batch has transfers of this file pending
+        void setBackend(std::unique_ptr<IOBackend> aBackend) { backend = std::move(aBackend); }
+
+        size_t getSize() const;
+        bool truncate(size_t aLength);
+
+        /* Pointer to [anOffset, anOffset + aLength) inside the mapped file. When the range lies past the current
+         * mapping (the archive grew) the file is remapped at its current size. Views are only valid until the next
+         * call that can remap or truncate; nullptr if the range is not in the file or the file can't be mapped
+         */
+        const char* getView(size_t anOffset, size_t aLength);
+        void unmap();
+
+        /* caches the file from aBase on in aFrameCount pages of aPageSize instead of mapping it; 0 frames goes back to
+         * the mapping. Pending changes of a previous pool are written first; false if that fails
+         */
+        bool setPool(size_t aBase, size_t aPageSize, size_t aFrameCount);
+        BufferPool* getPool() { return pool.get(); }
+        size_t getPoolBase() const { return poolBase; }
+        // writes back the changes pending in the pool
+        bool flushPool();
+
+    protected:
+        // one read or write through the backend, in pieces kept in flight together; false if any piece failed
+        bool transferAt(bool isWrite, char *aBuffer, size_t aLength, size_t anOffset) const;
+        // copies written bytes into the pages they overlap
+        void updatePool(const char *aBuffer, size_t aLength, size_t anOffset);
+        // the pages overlapping [anOffset, anOffset + aLength), as [first, last)
+        std::pair<size_t, size_t> getPoolPages(size_t anOffset, size_t aLength) const;
+        bool openDirect();
+        // the direct descriptor if the transfer qualifies for it, the buffered one otherwise
+        int getFd(const char *aBuffer, size_t aLength, size_t anOffset) const;
+
+        std::string path;
+        int fd;
+        int directFd;
+        bool shouldBeDirect;
+        char* mapData;
+        size_t mapLength;
+        std::unique_ptr<IOBackend> backend;
+        std::unique_ptr<BufferPool> pool;
+        size_t poolBase;
+    };
+
+}
+
+#endif /* ArchiveFile_hpp */
@@ -0,0 +1,138 @@
+//
+//  BufferPool.cpp
+//
+
+#include "BufferPool.hpp"
+#include <algorithm>
+#include <cstring>
+
+namespace ECE141 {
+
+    BufferPool::Pin::Pin(const Pin &aPin) : pool(aPin.pool), frame(aPin.frame), data(aPin.data){
+        if(pool){ pool->addPin(frame); }
+    }
+
+    BufferPool::Pin& BufferPool::Pin::operator=(const Pin &aPin){
+        if(this != &aPin){
+            if(aPin.pool){ aPin.pool->addPin(aPin.frame); }
+            if(pool){ pool->unpin(frame); }
+            pool = aPin.pool;
+            frame = aPin.frame;
+            data = aPin.data;
+        }
+        return *this;
+    }
+
+    BufferPool::Pin::~Pin(){
+        if(pool){ pool->unpin(frame); }
+    }
+
+    BufferPool::BufferPool(size_t aPageSize, size_t aFrameCount, Loader aLoader, Storer aStorer)
+        : pageSize(aPageSize), memory(aPageSize * std::max<size_t>(aFrameCount, 1)),
+          frames(std::max<size_t>(aFrameCount, 1), Frame{0, 0, 0, 0, false, false}), hand(0), load(std::move(aLoader)),
+          store(std::move(aStorer)), hits(0), misses(0) {}
+
+    BufferPool::Pin BufferPool::pin(size_t aPage){
+        std::lock_guard<std::mutex> theLock(mutex);
+        auto theResident = pageFrames.find(aPage);
+        if(theResident != pageFrames.end()){
+            Frame &theFrame = frames[theResident->second];
+            theFrame.pinCount++;
+            theFrame.isReferenced = true;
+            hits++;
+            return Pin(this, theResident->second, getFrameData(theResident->second));
+        }
+        misses++;
+        size_t theVictim = findVictim();
+        if(theVictim == SIZE_MAX){ return Pin(); }
+        Frame &theFrame = frames[theVictim];
+        if(theFrame.isValid){
+            if(!writeBack(theVictim)){ return Pin(); }
+            pageFrames.erase(theFrame.page);
+            theFrame.isValid = false;
+        }
+        if(!load(aPage, getFrameData(theVictim))){ return Pin(); }
+        theFrame = Frame{aPage, 1, 0, 0, true, true};
+        pageFrames[aPage] = theVictim;
+        return Pin(this, theVictim, getFrameData(theVictim));
+    }
+
+    size_t BufferPool::findVictim(){
+        // two sweeps: the first may only clear reference bits
+        for(size_t theStep=0; theStep < 2 * frames.size(); theStep++){
+            size_t theCandidate = hand;
+            hand = (hand + 1) % frames.size();
+            Frame &theFrame = frames[theCandidate];
+            if(theFrame.pinCount){ continue; }
+            if(!theFrame.isValid){ return theCandidate; }
+            if(theFrame.isReferenced){
+                theFrame.isReferenced = false;
+                continue;
+            }
+            return theCandidate;
+        }
+        return SIZE_MAX;
+    }
+
+    void BufferPool::markDirty(const Pin &aPin, size_t anOffset, size_t aLength){
+        std::lock_guard<std::mutex> theLock(mutex);
+        Frame &theFrame = frames[aPin.frame];
+        if(theFrame.dirtyBegin == theFrame.dirtyEnd){
+            theFrame.dirtyBegin = anOffset;
+            theFrame.dirtyEnd = anOffset + aLength;
+        }
+        else{
+            theFrame.dirtyBegin = std::min(theFrame.dirtyBegin, anOffset);
+            theFrame.dirtyEnd = std::max(theFrame.dirtyEnd, anOffset + aLength);
+        }
+    }
+
+    void BufferPool::update(size_t aPage, size_t anOffset, const char *aData, size_t aLength){
+        std::lock_guard<std::mutex> theLock(mutex);
+        auto theResident = pageFrames.find(aPage);
+        if(theResident != pageFrames.end()){ std::memcpy(getFrameData(theResident->second) + anOffset, aData, aLength); }
+    }
+
+    bool BufferPool::writeBack(size_t aFrame){
+        Frame &theFrame = frames[aFrame];
+        if(theFrame.dirtyBegin == theFrame.dirtyEnd){ return true; }
+        if(!store(theFrame.page, theFrame.dirtyBegin, getFrameData(aFrame) + theFrame.dirtyBegin,
+                  theFrame.dirtyEnd - theFrame.dirtyBegin)){
+            return false;
+        }
+        theFrame.dirtyBegin = theFrame.dirtyEnd = 0;
+        return true;
+    }
+
+    bool BufferPool::flush(size_t aFirst, size_t aLast){
+        std::lock_guard<std::mutex> theLock(mutex);
+        bool isOK = true;
+        for(size_t i=0; i<frames.size(); i++){
+            if(frames[i].isValid && frames[i].page >= aFirst && frames[i].page < aLast && !writeBack(i)){ isOK = false; }
+        }
+        return isOK;
+    }
+
+    void BufferPool::drop(size_t aFirst){
+        std::lock_guard<std::mutex> theLock(mutex);
+        for(auto& theFrame: frames){
+            if(theFrame.isValid && theFrame.page >= aFirst){
+                pageFrames.erase(theFrame.page);
+                // a pinned frame stays readable for its holder, it just no longer stands for the page
+                theFrame.isValid = false;
+                theFrame.dirtyBegin = theFrame.dirtyEnd = 0;
+            }
+        }
+    }
+
+    void BufferPool::addPin(size_t aFrame){
+        std::lock_guard<std::mutex> theLock(mutex);
+        frames[aFrame].pinCount++;
+    }
+
+    void BufferPool::unpin(size_t aFrame){
+        std::lock_guard<std::mutex> theLock(mutex);
+        frames[aFrame].pinCount--;
+    }
+
+}
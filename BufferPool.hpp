@@ -0,0 +1,119 @@
+//
+//  BufferPool.hpp
+//
+
+#ifndef BufferPool_hpp
+#define BufferPool_hpp
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <new>
+#include <unordered_map>
+#include <vector>
+
+namespace ECE141 {
+
+    const size_t kDirectIOAlignment = 4096; // address, offset and length alignment of O_DIRECT transfers
+
+    // hands out memory starting on a kDirectIOAlignment boundary, so buffers can take part in direct transfers
+    template <typename T>
+    struct AlignedAllocator {
+        using value_type = T;
+        AlignedAllocator() = default;
+        template <typename U> AlignedAllocator(const AlignedAllocator<U>&) {}
+        T* allocate(size_t aCount){
+            return static_cast<T*>(::operator new(aCount * sizeof(T), std::align_val_t(kDirectIOAlignment)));
+        }
+        void deallocate(T* aPointer, size_t){ ::operator delete(aPointer, std::align_val_t(kDirectIOAlignment)); }
+        template <typename U> bool operator==(const AlignedAllocator<U>&) const { return true; }
+        template <typename U> bool operator!=(const AlignedAllocator<U>&) const { return false; }
+    };
+
+    using AlignedBuffer = std::vector<char, AlignedAllocator<char>>;
+
+    /* Frames of one fixed page size caching pages of a file, replaced by CLOCK: the hand skips pinned frames and
+     * gives frames used since it last passed a second chance, so pages that keep being looked at (headers, the first
+     * blocks of files) stay while a long scan cycles through the rest. Changes made in a frame are tracked as a dirty
+     * byte span and written back when the frame is replaced or on flush(). Frames are aligned for direct I/O as
+     * long as the page size is a multiple of kDirectIOAlignment
+     */
+    class BufferPool {
+    public:
+        // a pinned frame: it can't be replaced while a copy of its pin is alive
+        class Pin {
+        public:
+            Pin() : pool(nullptr), frame(0), data(nullptr) {}
+            Pin(const Pin &aPin);
+            Pin& operator=(const Pin &aPin);
+            ~Pin();
+            char* getData() const { return data; }
+            explicit operator bool() const { return data != nullptr; }
+
+        protected:
+            friend class BufferPool;
+            Pin(BufferPool *aPool, size_t aFrame, char *aData) : pool(aPool), frame(aFrame), data(aData) {}
+
+            BufferPool* pool;
+            size_t frame;
+            char* data;
+        };
+
+        // fill aFrame with page aPage; write aLength changed bytes at anOffset of page aPage
+        using Loader = std::function<bool(size_t aPage, char *aFrame)>;
+        using Storer = std::function<bool(size_t aPage, size_t anOffset, const char *aData, size_t aLength)>;
+
+        BufferPool(size_t aPageSize, size_t aFrameCount, Loader aLoader, Storer aStorer);
+        BufferPool(const BufferPool&) = delete;
+        BufferPool& operator=(const BufferPool&) = delete;
+
+        size_t getPageSize() const { return pageSize; }
+        /* aPage resident and pinned, read in on a miss (the frame it replaces is written back first); empty if it
+         * can't be read or every frame is pinned
+         */
+        Pin pin(size_t aPage);
+        // records that [anOffset, anOffset + aLength) of the pinned frame changed
+        void markDirty(const Pin &aPin, size_t anOffset, size_t aLength);
+        // copies bytes that were written to the file around the pool into aPage, if it is resident
+        void update(size_t aPage, size_t anOffset, const char *aData, size_t aLength);
+        // writes back what changed in pages [aFirst, aLast); false if a write failed
+        bool flush(size_t aFirst=0, size_t aLast=SIZE_MAX);
+        // forgets the pages from aFirst on, changed or not, e.g. once the file was cut short there
+        void drop(size_t aFirst=0);
+
+        size_t getHits() const { return hits; }
+        size_t getMisses() const { return misses; }
+
+    protected:
+        struct Frame {
+            size_t page;
+            size_t pinCount;
+            size_t dirtyBegin; // dirty span; empty when dirtyBegin == dirtyEnd
+            size_t dirtyEnd;
+            bool isReferenced;
+            bool isValid;
+        };
+
+        char* getFrameData(size_t aFrame) { return memory.data() + aFrame * pageSize; }
+        bool writeBack(size_t aFrame);
+        // the frame the hand settles on; SIZE_MAX if all are pinned
+        size_t findVictim();
+        void addPin(size_t aFrame);
+        void unpin(size_t aFrame);
+
+        size_t pageSize;
+        AlignedBuffer memory;
+        std::vector<Frame> frames;
+        std::unordered_map<size_t, size_t> pageFrames; // resident page -> its frame
+        size_t hand;
+        Loader load;
+        Storer store;
+        size_t hits;
+        size_t misses;
+        std::mutex mutex;
+    };
+
+}
+
+#endif /* BufferPool_hpp */
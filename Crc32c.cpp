@@ -0,0 +1,71 @@
+//
+//  Crc32c.cpp
+//
+
+#include "Crc32c.hpp"
+#include <cstring>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+namespace ECE141 {
+
+    static const uint32_t kCrc32cPolynomial = 0x82F63B78; // reflected
+
+    // tables[k][b]: the crc of byte b followed by k zero bytes, so eight bytes can be folded in at once
+    struct Crc32cTables {
+        Crc32cTables(){
+            for(uint32_t i=0; i<256; i++){
+                uint32_t theCrc = i;
+                for(int theBit=0; theBit<8; theBit++){ theCrc = (theCrc >> 1) ^ (kCrc32cPolynomial & (0 - (theCrc & 1))); }
+                tables[0][i] = theCrc;
+            }
+            for(uint32_t i=0; i<256; i++){
+                for(int k=1; k<8; k++){ tables[k][i] = (tables[k-1][i] >> 8) ^ tables[0][tables[k-1][i] & 0xFF]; }
+            }
+        }
+        uint32_t tables[8][256];
+    };
+
+    static inline uint32_t loadLittleEndian32(const unsigned char *aData){
+        return aData[0] | (aData[1] << 8) | (aData[2] << 16) | (static_cast<uint32_t>(aData[3]) << 24);
+    }
+
+    static uint32_t crc32cSoftware(uint32_t aCrc, const unsigned char *aData, size_t aLength){
+        static const Crc32cTables theTables;
+        const auto& t = theTables.tables;
+        for(; aLength >= 8; aData += 8, aLength -= 8){
+            uint32_t theLow = aCrc ^ loadLittleEndian32(aData);
+            uint32_t theHigh = loadLittleEndian32(aData + 4);
+            aCrc = t[7][theLow & 0xFF] ^ t[6][(theLow >> 8) & 0xFF] ^ t[5][(theLow >> 16) & 0xFF] ^ t[4][theLow >> 24] ^
+                   t[3][theHigh & 0xFF] ^ t[2][(theHigh >> 8) & 0xFF] ^ t[1][(theHigh >> 16) & 0xFF] ^ t[0][theHigh >> 24];
+        }
+        while(aLength--){ aCrc = t[0][(aCrc ^ *aData++) & 0xFF] ^ (aCrc >> 8); }
+        return aCrc;
+    }
+
+#if defined(__x86_64__)
+    __attribute__((target("sse4.2")))
+    static uint32_t crc32cHardware(uint32_t aCrc, const unsigned char *aData, size_t aLength){
+        uint64_t theCrc = aCrc;
+        for(; aLength >= 8; aData += 8, aLength -= 8){
+            uint64_t theWord;
+            std::memcpy(&theWord, aData, sizeof(theWord));
+            theCrc = _mm_crc32_u64(theCrc, theWord);
+        }
+        uint32_t theResult = static_cast<uint32_t>(theCrc);
+        while(aLength--){ theResult = _mm_crc32_u8(theResult, *aData++); }
+        return theResult;
+    }
+#endif
+
+    uint32_t crc32c(const char *aData, size_t aLength, uint32_t aCrc){
+        const unsigned char* theData = reinterpret_cast<const unsigned char*>(aData);
+#if defined(__x86_64__)
+        static const bool hasHardware = __builtin_cpu_supports("sse4.2");
+        if(hasHardware){ return ~crc32cHardware(~aCrc, theData, aLength); }
+#endif
+        return ~crc32cSoftware(~aCrc, theData, aLength);
+    }
+
+}
@@ -0,0 +1,20 @@
+//
+//  Crc32c.hpp
+//
+
+#ifndef Crc32c_hpp
+#define Crc32c_hpp
+
+#include <cstddef>
+#include <cstdint>
+
+namespace ECE141 {
+
+    /* CRC-32C (Castagnoli), the checksum kept in every block header. Uses the SSE4.2 crc32 instruction when the CPU
+     * has it and slicing-by-8 tables otherwise; pass a previous result as aCrc to continue it over more data
+     */
+    uint32_t crc32c(const char *aData, size_t aLength, uint32_t aCrc=0);
+
+}
+
+#endif /* Crc32c_hpp */
@@ -0,0 +1,401 @@
+//
+//  IOBackend.cpp
+//
+
+#include "IOBackend.hpp"
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#define ECE141_HAS_IO_URING 1
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+namespace ECE141 {
+
+    IOBatch::IOBatch(IOBackend &aBackend) : backend(aBackend), pending(0), hasFailed(false) {}
+
+    IOBatch::~IOBatch(){
+        wait();
+    }
+
+    void IOBatch::submit(const IORequest* aRequests, size_t aCount){
+        if(!aCount){ return; }
+        {
+            std::lock_guard<std::mutex> theLock(mutex);
+            pending += aCount; // before the backend sees them, since they may complete right away
+        }
+        backend.submit(aRequests, aCount, *this);
+    }
+
+    bool IOBatch::wait(){
+        backend.wait(*this);
+        std::lock_guard<std::mutex> theLock(mutex);
+        bool isOK = !hasFailed;
+        hasFailed = false;
+        return isOK;
+    }
+
+    void IOBatch::complete(bool isOK){
+        std::lock_guard<std::mutex> theLock(mutex);
+        if(!isOK){ hasFailed = true; }
+        // notified under the lock: once pending reaches 0 the waiter may destroy the batch
+        if(!--pending){ signal.notify_all(); }
+    }
+
+    bool IOBatch::isDone(){
+        std::lock_guard<std::mutex> theLock(mutex);
+        return !pending;
+    }
+
+    void IOBackend::wait(IOBatch &aBatch){
+        std::unique_lock<std::mutex> theLock(aBatch.mutex);
+        aBatch.signal.wait(theLock, [&aBatch](){ return !aBatch.pending; });
+    }
+
+    bool IOBackend::transfer(const IORequest &aRequest){
+        char* theBuffer = aRequest.buffer;
+        size_t theLength = aRequest.length;
+        size_t theOffset = aRequest.offset;
+        while(theLength){
+            ssize_t theCount = aRequest.isWrite ? ::pwrite(aRequest.fd, theBuffer, theLength, theOffset)
+                                                : ::pread(aRequest.fd, theBuffer, theLength, theOffset);
+            if(theCount < 0 && errno == EINTR){ continue; }
+            if(theCount <= 0){ return false; }
+            theBuffer += theCount;
+            theLength -= theCount;
+            theOffset += theCount;
+        }
+        return true;
+    }
+
+    //-------------------------------------------
+
+    // every transfer is done inside submit(), one after the other, like plain positional I/O
+    class SyncIOBackend : public IOBackend {
+    public:
+        IOBackendType getType() const override { return IOBackendType::synchronous; }
+        void submit(const IORequest* aRequests, size_t aCount, IOBatch &aBatch) override{
+            for(size_t i=0; i<aCount; i++){ aBatch.complete(transfer(aRequests[i])); }
+        }
+    };
+
+    //-------------------------------------------
+
+    // a fixed set of threads doing blocking pread/pwrite, so up to one transfer per thread is in flight
+    class ThreadPoolIOBackend : public IOBackend {
+    public:
+        explicit ThreadPoolIOBackend(size_t aThreadCount) : isStopping(false){
+            for(size_t i=0; i<aThreadCount; i++){ workers.emplace_back([this](){ run(); }); }
+        }
+
+        ~ThreadPoolIOBackend() override{
+            {
+                std::lock_guard<std::mutex> theLock(mutex);
+                isStopping = true;
+            }
+            signal.notify_all();
+            for(auto& theWorker: workers){ theWorker.join(); }
+        }
+
+        IOBackendType getType() const override { return IOBackendType::threadPool; }
+
+        void submit(const IORequest* aRequests, size_t aCount, IOBatch &aBatch) override{
+            {
+                std::lock_guard<std::mutex> theLock(mutex);
+                for(size_t i=0; i<aCount; i++){ queue.push_back({aRequests[i], &aBatch}); }
+            }
+            if(aCount > 1){ signal.notify_all(); }
+            else{ signal.notify_one(); }
+        }
+
+    protected:
+        void run(){
+            std::unique_lock<std::mutex> theLock(mutex);
+            while(true){
+                signal.wait(theLock, [this](){ return isStopping || !queue.empty(); });
+                // queued transfers are finished before stopping, so no batch is left waiting
+                if(queue.empty()){ return; }
+                auto [theRequest, theBatch] = queue.front();
+                queue.pop_front();
+                theLock.unlock();
+                theBatch->complete(transfer(theRequest));
+                theLock.lock();
+            }
+        }
+
+        std::mutex mutex;
+        std::condition_variable signal;
+        std::deque<std::pair<IORequest, IOBatch*>> queue;
+        bool isStopping;
+        std::vector<std::thread> workers;
+    };
+
+    //-------------------------------------------
+
+#ifdef ECE141_HAS_IO_URING
+    /* io_uring through the raw system calls: one submission/completion ring pair with a slot per transfer in flight.
+     * Submissions are batched into a single io_uring_enter; a reaper thread sleeps in the kernel for completions, so
+     * the ring lock is never held across a blocking call. Short transfers are resubmitted for the rest
+     */
+    class UringIOBackend : public IOBackend {
+    public:
+        static std::unique_ptr<IOBackend> open(size_t aQueueDepth){
+            std::unique_ptr<UringIOBackend> theBackend(new UringIOBackend());
+            if(!theBackend->setup(static_cast<unsigned>(std::max<size_t>(aQueueDepth, 1))) ||
+               !theBackend->probe()){ return nullptr; }
+            UringIOBackend* theRing = theBackend.get();
+            theBackend->reaper = std::thread([theRing](){ theRing->runReaper(); });
+            return theBackend;
+        }
+
+        ~UringIOBackend() override{
+            if(reaper.joinable()){
+                std::unique_lock<std::mutex> theLock(ringMutex);
+                slotFreed.wait(theLock, [this](){ return freeSlots.size() == slots.size(); });
+                // nothing is in flight, so a no-op is the only completion left to wake the reaper with
+                isStopping = true;
+                pushWakeup();
+                flush();
+                theLock.unlock();
+                reaper.join();
+            }
+            if(sqes != MAP_FAILED){ ::munmap(sqes, sqesSize); }
+            if(cqRing != MAP_FAILED && cqRing != sqRing){ ::munmap(cqRing, cqRingSize); }
+            if(sqRing != MAP_FAILED){ ::munmap(sqRing, sqRingSize); }
+            if(ringFd >= 0){ ::close(ringFd); }
+        }
+
+        IOBackendType getType() const override { return IOBackendType::ioUring; }
+
+        void submit(const IORequest* aRequests, size_t aCount, IOBatch &aBatch) override{
+            std::unique_lock<std::mutex> theLock(ringMutex);
+            for(size_t i=0; i<aCount; i++){
+                if(freeSlots.empty()){ // the queue is full: hand over what's queued and let the reaper make room
+                    flush();
+                    slotFreed.wait(theLock, [this](){ return !freeSlots.empty(); });
+                }
+                size_t theSlot = freeSlots.back();
+                freeSlots.pop_back();
+                slots[theSlot] = Slot{aRequests[i], &aBatch};
+                push(theSlot);
+            }
+            flush();
+        }
+
+    protected:
+        struct Slot {
+            IORequest request;
+            IOBatch* batch;
+        };
+
+        static constexpr uint64_t kWakeup = ~uint64_t(0); // user_data of the no-op that stops the reaper
+
+        UringIOBackend() : ringFd(-1), sqRing(MAP_FAILED), cqRing(MAP_FAILED), sqes(MAP_FAILED), unsubmitted(0),
+                           isStopping(false) {}
+
+        bool setup(unsigned anEntries){
+            io_uring_params theParams;
+            std::memset(&theParams, 0, sizeof(theParams));
+            ringFd = static_cast<int>(::syscall(__NR_io_uring_setup, anEntries, &theParams));
+            if(ringFd < 0){ return false; }
+            sqRingSize = theParams.sq_off.array + theParams.sq_entries * sizeof(unsigned);
+            cqRingSize = theParams.cq_off.cqes + theParams.cq_entries * sizeof(io_uring_cqe);
+            bool isSingleMap = theParams.features & IORING_FEAT_SINGLE_MMAP;
+            if(isSingleMap){ sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize); }
+            sqRing = ::mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd,
+                            IORING_OFF_SQ_RING);
+            if(sqRing == MAP_FAILED){ return false; }
+            cqRing = isSingleMap ? sqRing : ::mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE,
+                                                   MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+            if(cqRing == MAP_FAILED){ return false; }
+            sqesSize = theParams.sq_entries * sizeof(io_uring_sqe);
+            sqes = ::mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd,
+                          IORING_OFF_SQES);
+            if(sqes == MAP_FAILED){ return false; }
+
+            char* theSq = static_cast<char*>(sqRing);
+            sqTail = reinterpret_cast<unsigned*>(theSq + theParams.sq_off.tail);
+            sqMask = *reinterpret_cast<unsigned*>(theSq + theParams.sq_off.ring_mask);
+            sqArray = reinterpret_cast<unsigned*>(theSq + theParams.sq_off.array);
+            char* theCq = static_cast<char*>(cqRing);
+            cqHead = reinterpret_cast<unsigned*>(theCq + theParams.cq_off.head);
+            cqTail = reinterpret_cast<unsigned*>(theCq + theParams.cq_off.tail);
+            cqMask = *reinterpret_cast<unsigned*>(theCq + theParams.cq_off.ring_mask);
+            cqes = reinterpret_cast<io_uring_cqe*>(theCq + theParams.cq_off.cqes);
+            // no more in flight than the submission ring holds, so neither ring can overflow
+            slots.resize(theParams.sq_entries);
+            for(size_t i=slots.size(); i--;){ freeSlots.push_back(i); }
+            return true;
+        }
+
+        // true if the kernel does positional reads, writes and no-ops on this ring (IORING_OP_READ/WRITE are 5.6+)
+        bool probe(){
+            const unsigned theOpCount = 256;
+            std::vector<char> theBuffer(sizeof(io_uring_probe) + theOpCount * sizeof(io_uring_probe_op), 0);
+            io_uring_probe* theProbe = reinterpret_cast<io_uring_probe*>(theBuffer.data());
+            if(::syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_PROBE, theProbe, theOpCount) < 0){
+                return false; // kernels before 5.6 have no probe and no IORING_OP_READ/WRITE either
+            }
+            auto isSupported = [theProbe](unsigned anOp){
+                return anOp <= theProbe->last_op && (theProbe->ops[anOp].flags & IO_URING_OP_SUPPORTED);
+            };
+            return isSupported(IORING_OP_READ) && isSupported(IORING_OP_WRITE) && isSupported(IORING_OP_NOP);
+        }
+
+        // sleeps in the kernel until completions arrive, without the ring lock, then reaps them under it
+        void runReaper(){
+            while(true){
+                long theCount = ::syscall(__NR_io_uring_enter, ringFd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+                if(theCount < 0 && errno == EINTR){ continue; }
+                std::lock_guard<std::mutex> theLock(ringMutex);
+                reap();
+                if(isStopping){ return; }
+            }
+        }
+
+        // queues the (rest of the) transfer in aSlot; it reaches the kernel with the next flush()
+        void push(size_t aSlot){
+            const IORequest &theRequest = slots[aSlot].request;
+            io_uring_sqe &theEntry = nextEntry();
+            theEntry.opcode = theRequest.isWrite ? IORING_OP_WRITE : IORING_OP_READ;
+            theEntry.fd = theRequest.fd;
+            theEntry.off = theRequest.offset;
+            theEntry.addr = reinterpret_cast<uintptr_t>(theRequest.buffer);
+            theEntry.len = static_cast<unsigned>(std::min<size_t>(theRequest.length, 1u << 30)); // the rest follows
+            theEntry.user_data = aSlot;
+            commitEntry();
+        }
+
+        void pushWakeup(){
+            io_uring_sqe &theEntry = nextEntry();
+            theEntry.opcode = IORING_OP_NOP;
+            theEntry.user_data = kWakeup;
+            commitEntry();
+        }
+
+        // the cleared entry at the submission tail
+        io_uring_sqe& nextEntry(){
+            unsigned theIndex = *sqTail & sqMask;
+            io_uring_sqe &theEntry = static_cast<io_uring_sqe*>(sqes)[theIndex];
+            std::memset(&theEntry, 0, sizeof(theEntry));
+            sqArray[theIndex] = theIndex;
+            return theEntry;
+        }
+
+        void commitEntry(){
+            __atomic_store_n(sqTail, *sqTail + 1, __ATOMIC_RELEASE);
+            unsubmitted++;
+        }
+
+        // hands the queued entries to the kernel without waiting for any of them
+        void flush(){
+            while(unsubmitted){
+                long theCount = ::syscall(__NR_io_uring_enter, ringFd, unsubmitted, 0, 0, nullptr, 0);
+                if(theCount > 0){
+                    unsubmitted -= std::min<unsigned>(static_cast<unsigned>(theCount), unsubmitted);
+                    continue;
+                }
+                if(theCount < 0 && errno == EINTR){ continue; }
+                // the completion ring is backed up: take what's waiting and try again
+                if(theCount < 0 && (errno == EAGAIN || errno == EBUSY) && reap()){ continue; }
+                failUnsubmitted();
+            }
+        }
+
+        // the kernel refused the queued entries: take them back and do them in place
+        void failUnsubmitted(){
+            unsigned theTail = *sqTail;
+            for(unsigned thePos = theTail - unsubmitted; thePos != theTail; thePos++){
+                uint64_t theData = static_cast<io_uring_sqe*>(sqes)[sqArray[thePos & sqMask]].user_data;
+                if(theData == kWakeup){ continue; }
+                size_t theSlot = static_cast<size_t>(theData);
+                slots[theSlot].batch->complete(transfer(slots[theSlot].request));
+                freeSlots.push_back(theSlot);
+            }
+            __atomic_store_n(sqTail, theTail - unsubmitted, __ATOMIC_RELEASE);
+            unsubmitted = 0;
+            slotFreed.notify_all();
+        }
+
+        // takes every completion off the ring and wakes submitters waiting for a slot; true if there were any
+        bool reap(){
+            unsigned theHead = *cqHead;
+            unsigned theTail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+            bool hasReaped = theHead != theTail;
+            bool hasFreed = false;
+            for(; theHead != theTail; theHead++){
+                const io_uring_cqe &theCompletion = cqes[theHead & cqMask];
+                if(theCompletion.user_data == kWakeup){ continue; }
+                size_t theSlot = static_cast<size_t>(theCompletion.user_data);
+                Slot &theEntry = slots[theSlot];
+                int theResult = theCompletion.res;
+                if(theResult == -EINTR || theResult == -EAGAIN){
+                    push(theSlot);
+                    continue;
+                }
+                if(theResult > 0 && static_cast<size_t>(theResult) < theEntry.request.length){
+                    theEntry.request.buffer += theResult;
+                    theEntry.request.length -= theResult;
+                    theEntry.request.offset += theResult;
+                    push(theSlot);
+                    continue;
+                }
+                theEntry.batch->complete(theResult > 0 || (theResult == 0 && !theEntry.request.length));
+                freeSlots.push_back(theSlot);
+                hasFreed = true;
+            }
+            __atomic_store_n(cqHead, theHead, __ATOMIC_RELEASE);
+            if(hasFreed){ slotFreed.notify_all(); }
+            if(unsubmitted && hasReaped){ flush(); } // the resubmitted rests
+            return hasReaped;
+        }
+
+        int ringFd;
+        void* sqRing;
+        size_t sqRingSize;
+        void* cqRing;
+        size_t cqRingSize;
+        void* sqes;
+        size_t sqesSize;
+        unsigned* sqTail;
+        unsigned sqMask;
+        unsigned* sqArray;
+        unsigned* cqHead;
+        unsigned* cqTail;
+        unsigned cqMask;
+        io_uring_cqe* cqes;
+        unsigned unsubmitted; // entries queued in the ring but not handed to the kernel yet
+        std::vector<Slot> slots;
+        std::vector<size_t> freeSlots;
+        bool isStopping;
+        std::mutex ringMutex; // guards the rings, the slots and isStopping
+        std::condition_variable slotFreed;
+        std::thread reaper;
+    };
+#endif
+
+    //-------------------------------------------
+
+    std::unique_ptr<IOBackend> IOBackend::create(IOBackendType aType, size_t aQueueDepth){
+        switch(aType){
+            case IOBackendType::synchronous: return std::make_unique<SyncIOBackend>();
+            case IOBackendType::threadPool:
+                return std::make_unique<ThreadPoolIOBackend>(std::max<size_t>(aQueueDepth, 1));
+            case IOBackendType::ioUring:
+#ifdef ECE141_HAS_IO_URING
+                return UringIOBackend::open(aQueueDepth);
+#else
+                return nullptr;
+#endif
+        }
+        return nullptr;
+    }
+
+}
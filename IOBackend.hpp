@@ -0,0 +1,84 @@
+//
+//  IOBackend.hpp
+//
+
+#ifndef IOBackend_hpp
+#define IOBackend_hpp
+
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+
+namespace ECE141 {
+
+    const size_t kIOQueueDepth = 32; // transfers a backend keeps in flight at once
+    const size_t kIOPieceSize = 256 * 1024; // large transfers are queued in pieces of this size, a direct I/O multiple
+
+    enum class IOBackendType {synchronous, threadPool, ioUring};
+
+    // one positional transfer of a whole buffer; the buffer has to stay valid until the transfer completed
+    struct IORequest {
+        bool isWrite;
+        int fd;
+        char* buffer; // only read from for writes
+        size_t length;
+        size_t offset;
+    };
+
+    class IOBackend;
+
+    /* Counts the transfers submitted under it until they complete. wait() may be called any number of times, and the
+     * batch can take new transfers afterwards; the destructor waits too, so buffers declared before a batch outlive
+     * the transfers it tracks
+     */
+    class IOBatch {
+    public:
+        explicit IOBatch(IOBackend &aBackend);
+        ~IOBatch();
+        IOBatch(const IOBatch&) = delete;
+        IOBatch& operator=(const IOBatch&) = delete;
+
+        void submit(const IORequest* aRequests, size_t aCount);
+        void submit(const IORequest &aRequest) { submit(&aRequest, 1); }
+        // blocks until nothing submitted is pending; false if any transfer since the last wait() failed or was short
+        bool wait();
+
+        // called by the backend once per submitted transfer
+        void complete(bool isOK);
+        bool isDone();
+
+    protected:
+        friend class IOBackend;
+
+        IOBackend &backend;
+        std::mutex mutex;
+        std::condition_variable signal;
+        size_t pending;
+        bool hasFailed;
+    };
+
+    /* Carries out positional reads and writes for the archive. submit() may return before the transfers are done;
+     * every one of them is reported to its batch exactly once, whole or failed (short transfers are continued by the
+     * backend). Backends are shared by the threads of one archive, so submit() and wait() are thread safe
+     */
+    class IOBackend {
+    public:
+        virtual ~IOBackend() = default;
+        virtual IOBackendType getType() const = 0;
+        virtual void submit(const IORequest* aRequests, size_t aCount, IOBatch &aBatch) = 0;
+        // blocks until aBatch has nothing pending; backends that complete transfers on their own just sleep on it
+        virtual void wait(IOBatch &aBatch);
+
+        /* a backend of aType keeping up to aQueueDepth transfers in flight (the thread pool runs that many threads);
+         * nullptr if this system can't provide it, e.g. io_uring is missing or disabled
+         */
+        static std::unique_ptr<IOBackend> create(IOBackendType aType, size_t aQueueDepth=kIOQueueDepth);
+
+        // the whole transfer with plain pread/pwrite calls, retried until done; false on an error or end of file
+        static bool transfer(const IORequest &aRequest);
+    };
+
+}
+
+#endif /* IOBackend_hpp */
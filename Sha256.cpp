@@ -0,0 +1,110 @@
+//
+//  Sha256.cpp
+//
+
+#include "Sha256.hpp"
+#include <cstring>
+#include <algorithm>
+
+namespace ECE141 {
+
+    static const uint32_t kRoundConstants[64] = {
+            0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+            0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+            0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+            0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+            0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+            0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+            0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+            0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+    };
+
+    static inline uint32_t rotateRight(uint32_t aValue, int aCount){
+        return (aValue >> aCount) | (aValue << (32 - aCount));
+    }
+
+    Sha256::Sha256(){
+        reset();
+    }
+
+    void Sha256::reset(){
+        static const uint32_t kInitialState[8] = {
+                0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+        };
+        std::memcpy(state, kInitialState, sizeof(state));
+        bufferLength = 0;
+        totalLength = 0;
+    }
+
+    void Sha256::transform(const uint8_t *aBlock){
+        uint32_t theSchedule[64];
+        for(int i=0; i<16; i++){
+            theSchedule[i] = uint32_t(aBlock[i * 4]) << 24 | uint32_t(aBlock[i * 4 + 1]) << 16 |
+                             uint32_t(aBlock[i * 4 + 2]) << 8 | uint32_t(aBlock[i * 4 + 3]);
+        }
+        for(int i=16; i<64; i++){
+            uint32_t s0 = rotateRight(theSchedule[i - 15], 7) ^ rotateRight(theSchedule[i - 15], 18) ^ (theSchedule[i - 15] >> 3);
+            uint32_t s1 = rotateRight(theSchedule[i - 2], 17) ^ rotateRight(theSchedule[i - 2], 19) ^ (theSchedule[i - 2] >> 10);
+            theSchedule[i] = theSchedule[i - 16] + s0 + theSchedule[i - 7] + s1;
+        }
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+        for(int i=0; i<64; i++){
+            uint32_t S1 = rotateRight(e, 6) ^ rotateRight(e, 11) ^ rotateRight(e, 25);
+            uint32_t theChoice = (e & f) ^ (~e & g);
+            uint32_t temp1 = h + S1 + theChoice + kRoundConstants[i] + theSchedule[i];
+            uint32_t S0 = rotateRight(a, 2) ^ rotateRight(a, 13) ^ rotateRight(a, 22);
+            uint32_t theMajority = (a & b) ^ (a & c) ^ (b & c);
+            uint32_t temp2 = S0 + theMajority;
+            h = g;
+            g = f;
+            f = e;
+            e = d + temp1;
+            d = c;
+            c = b;
+            b = a;
+            a = temp1 + temp2;
+        }
+        state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+        state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+    }
+
+    Sha256& Sha256::update(const char *aData, size_t aLength){
+        const uint8_t* theData = reinterpret_cast<const uint8_t*>(aData);
+        totalLength += aLength;
+        if(bufferLength){
+            size_t theCount = std::min(aLength, sizeof(buffer) - bufferLength);
+            std::memcpy(buffer + bufferLength, theData, theCount);
+            bufferLength += theCount;
+            theData += theCount;
+            aLength -= theCount;
+            if(bufferLength < sizeof(buffer)){ return *this; }
+            transform(buffer);
+            bufferLength = 0;
+        }
+        // whole blocks straight from the input
+        for(; aLength >= sizeof(buffer); theData += sizeof(buffer), aLength -= sizeof(buffer)){ transform(theData); }
+        std::memcpy(buffer, theData, aLength);
+        bufferLength = aLength;
+        return *this;
+    }
+
+    std::string Sha256::finish(){
+        uint64_t theBitLength = totalLength * 8;
+        uint8_t thePadding[72] = {0x80};
+        // pad to 56 mod 64, then the message length in bits, big endian
+        size_t thePadLength = (bufferLength < 56 ? 56 : 120) - bufferLength;
+        for(int i=0; i<8; i++){ thePadding[thePadLength + i] = static_cast<uint8_t>(theBitLength >> (56 - i * 8)); }
+        update(reinterpret_cast<const char*>(thePadding), thePadLength + 8);
+        std::string theDigest(kSha256Size, '\0');
+        for(int i=0; i<8; i++){
+            for(int j=0; j<4; j++){ theDigest[i * 4 + j] = static_cast<char>(state[i] >> (24 - j * 8)); }
+        }
+        return theDigest;
+    }
+
+    std::string Sha256::digest(const char *aData, size_t aLength){
+        return Sha256().update(aData, aLength).finish();
+    }
+
+}
@@ -0,0 +1,38 @@
+//
+//  Sha256.hpp
+//
+
+#ifndef Sha256_hpp
+#define Sha256_hpp
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace ECE141 {
+
+    const size_t kSha256Size = 32;
+
+    // FIPS 180-4 SHA-256, used to key deduplicated chunks by their contents
+    class Sha256 {
+    public:
+        Sha256();
+        Sha256& update(const char *aData, size_t aLength);
+        // the kSha256Size raw digest bytes; the object has to be reset before it is used again
+        std::string finish();
+        void reset();
+
+        static std::string digest(const char *aData, size_t aLength);
+
+    protected:
+        void transform(const uint8_t *aBlock);
+
+        uint32_t state[8];
+        uint8_t buffer[64];
+        size_t bufferLength;
+        uint64_t totalLength;
+    };
+
+}
+
+#endif /* Sha256_hpp */
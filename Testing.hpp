@@ -691,6 +691,708 @@ namespace ECE141 {
             return theResult;
         }
 
+        //-------------------------------------------
+
+        bool doResizeTests(std::ostream& anOutput) {
+            std::string theFullPath(folder + "/resizetest.arc");
+            size_t thePreCount = 0;
+            {
+                ArchiveStatus<std::shared_ptr<Archive>> theArchive = Archive::createArchive(theFullPath);
+                if (!theArchive.isOK()) {
+                    anOutput << "Failed to create archive\n";
+                    return false;
+                }
+                Compression theProcessor;
+                addTestFiles(*theArchive.getValue());
+                addTestFile(*theArchive.getValue(), "Xlarge", 'B', &theProcessor);
+                std::stringstream theStream;
+                thePreCount = theArchive.getValue()->debugDump(theStream).getValue();
+                if (!theArchive.getValue()->resize(4096).isOK()) {
+                    anOutput << "resize failed\n";
+                    return false;
+                }
+                if (theArchive.getValue()->resize(1000).isOK()) {
+                    anOutput << "resize accepted a bad block size\n";
+                    return false;
+                }
+            }
+            ArchiveStatus<std::shared_ptr<Archive>> theArchive = Archive::openArchive(theFullPath);
+            if (!theArchive.isOK() || theArchive.getValue()->getBlockSize() != 4096) {
+                anOutput << "Block size was not persisted\n";
+                return false;
+            }
+            std::stringstream theStream;
+            size_t thePostCount = theArchive.getValue()->debugDump(theStream).getValue();
+            if (thePostCount >= thePreCount) {
+                anOutput << "Resized archive doesn't use fewer blocks\n";
+                return false;
+            }
+            std::string temp(folder + "/out.txt");
+            for (auto theFileName : {pickRandomFile(), std::string("XlargeA.txt"), std::string("XlargeB.txt")}) {
+                theArchive.getValue()->extract(theFileName, temp);
+                if (!filesMatch(theFileName, temp)) {
+                    anOutput << "Extracted file doesn't match original.\n";
+                    return false;
+                }
+            }
+            // a file added after the resize must not share a name id with the copied ones, or recovery, which keeps
+            // one chain per id, loses one of them
+            std::stringstream theBefore;
+            size_t theListed = theArchive.getValue()->list(theBefore).getValue();
+            addTestFile(*theArchive.getValue(), "small", 'B');
+            theArchive.getValue()->reconstructTOC();
+            std::stringstream theAfter;
+            if (theArchive.getValue()->list(theAfter).getValue() != theListed + 1) {
+                anOutput << "A file added after resize was lost in recovery\n";
+                return false;
+            }
+            for (auto theFileName : {std::string("smallA.txt"), std::string("smallB.txt")}) {
+                theArchive.getValue()->extract(theFileName, temp);
+                if (!filesMatch(theFileName, temp)) {
+                    anOutput << "Extracted file doesn't match original.\n";
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        //-------------------------------------------
+
+        bool doCompactTests(std::ostream& anOutput) {
+            std::string theFullPath(folder + "/compacttest.arc");
+            {
+                ArchiveStatus<std::shared_ptr<Archive>> theArchive = Archive::createArchive(theFullPath);
+                if (!theArchive.isOK()) {
+                    anOutput << "Failed to create archive\n";
+                    return false;
+                }
+                Compression theProcessor;
+                addTestFiles(*theArchive.getValue());
+                addTestFiles(*theArchive.getValue(), 'B', &theProcessor);
+                // holes in front of everything else, so every later block has to move
+                theArchive.getValue()->remove("smallA.txt");
+                theArchive.getValue()->remove("XlargeA.txt");
+                theArchive.getValue()->flush();
+                size_t thePreSize = getFileSize(theFullPath);
+                std::stringstream theStream;
+                size_t thePreCount = theArchive.getValue()->debugDump(theStream).getValue();
+                ArchiveStatus<size_t> theStatus = theArchive.getValue()->compact();
+                if (!theStatus.isOK() || theStatus.getValue() >= thePreCount) {
+                    anOutput << "compact didn't drop the free blocks\n";
+                    return false;
+                }
+                if (getFileSize(theFullPath) >= thePreSize) {
+                    anOutput << "compact didn't shrink the archive\n";
+                    return false;
+                }
+            }
+            ArchiveStatus<std::shared_ptr<Archive>> theArchive = Archive::openArchive(theFullPath);
+            if (!theArchive.isOK()) {
+                anOutput << "Failed to open archive\n";
+                return false;
+            }
+            std::string temp(folder + "/out.txt");
+            for (auto theFileName : {"mediumA.txt", "largeA.txt", "smallB.txt", "mediumB.txt", "largeB.txt", "XlargeB.txt"}) {
+                theArchive.getValue()->extract(theFileName, temp);
+                if (!filesMatch(theFileName, temp)) {
+                    anOutput << "Extracted file doesn't match original.\n";
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        //-------------------------------------------
+
+        bool doIncrementalCompactTests(std::ostream& anOutput) {
+            std::string theFullPath(folder + "/incrementaltest.arc");
+            ArchiveStatus<std::shared_ptr<Archive>> theArchive = Archive::createArchive(theFullPath);
+            if (!theArchive.isOK()) {
+                anOutput << "Failed to create archive\n";
+                return false;
+            }
+            addTestFiles(*theArchive.getValue());
+            addTestFiles(*theArchive.getValue(), 'B');
+            theArchive.getValue()->remove("mediumA.txt");
+            theArchive.getValue()->remove("XlargeA.txt");
+            if (theArchive.getValue()->getFragmentation() <= 0.0) {
+                anOutput << "Removing files didn't fragment the archive\n";
+                return false;
+            }
+            const size_t theBudget = 16;
+            size_t theSteps = 0;
+            for (;;) {
+                ArchiveStatus<size_t> theStatus = theArchive.getValue()->compactStep(theBudget);
+                if (!theStatus.isOK() || theStatus.getValue() > theBudget) {
+                    anOutput << "compactStep failed or went over its budget\n";
+                    return false;
+                }
+                if (!theStatus.getValue()) { break; }
+                theSteps++;
+            }
+            if (theSteps < 2 || theArchive.getValue()->getFragmentation() != 0.0) {
+                anOutput << "Archive wasn't compacted in steps\n";
+                return false;
+            }
+            std::string temp(folder + "/out.txt");
+            for (auto theFileName : {"smallA.txt", "largeA.txt", "smallB.txt", "mediumB.txt", "largeB.txt", "XlargeB.txt"}) {
+                theArchive.getValue()->extract(theFileName, temp);
+                if (!filesMatch(theFileName, temp)) {
+                    anOutput << "Extracted file doesn't match original.\n";
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        //-------------------------------------------
+
+        bool doMergeTests(std::ostream& anOutput) {
+            std::string theFullPath(folder + "/mergetest.arc");
+            std::string theOtherPath(folder + "/mergeshard.arc");
+            {
+                ArchiveStatus<std::shared_ptr<Archive>> theOther = Archive::createArchive(theOtherPath);
+                if (!theOther.isOK()) {
+                    anOutput << "Failed to create archive\n";
+                    return false;
+                }
+                Compression theProcessor;
+                addTestFiles(*theOther.getValue(), 'B', &theProcessor);
+            }
+            {
+                ArchiveStatus<std::shared_ptr<Archive>> theArchive = Archive::createArchive(theFullPath);
+                if (!theArchive.isOK()) {
+                    anOutput << "Failed to create archive\n";
+                    return false;
+                }
+                addTestFiles(*theArchive.getValue());
+                theArchive.getValue()->remove("mediumA.txt");
+                if (!theArchive.getValue()->merge(theOtherPath).isOK()) {
+                    anOutput << "merge failed\n";
+                    return false;
+                }
+                if (theArchive.getValue()->merge(theOtherPath).getError() != ArchiveErrors::fileExists) {
+                    anOutput << "merge didn't report the name collision\n";
+                    return false;
+                }
+            }
+            ArchiveStatus<std::shared_ptr<Archive>> theArchive = Archive::openArchive(theFullPath);
+            if (!theArchive.isOK()) {
+                anOutput << "Failed to open archive\n";
+                return false;
+            }
+            std::string temp(folder + "/out.txt");
+            for (auto theFileName : {"smallA.txt", "XlargeA.txt", "smallB.txt", "mediumB.txt", "largeB.txt", "XlargeB.txt"}) {
+                theArchive.getValue()->extract(theFileName, temp);
+                if (!filesMatch(theFileName, temp)) {
+                    anOutput << "Extracted file doesn't match original.\n";
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        //-------------------------------------------
+
+        // copies some of the test files into a small folder tree; returns their names relative to the test folder
+        std::vector<std::string> makeTestTree(const std::string& aTree) {
+            std::filesystem::remove_all(aTree);
+            std::filesystem::create_directories(aTree + "/nested");
+            std::string theTreeName = std::filesystem::path(aTree).filename().string();
+            std::vector<std::string> theNames;
+            for (auto theName : {"/smallA.txt", "/XlargeA.txt", "/nested/mediumB.txt", "/nested/largeB.txt"}) {
+                theNames.push_back(theTreeName + theName);
+                std::filesystem::copy_file(folder + "/" + std::filesystem::path(theName).filename().string(),
+                                           folder + "/" + theNames.back());
+            }
+            return theNames;
+        }
+
+        bool doAddFolderTests(std::ostream& anOutput) {
+            std::string theFullPath(folder + "/addfoldertest.arc");
+            std::string theTree(folder + "/tree");
+            std::vector<std::string> theNames = makeTestTree(theTree);
+            ArchiveStatus<std::shared_ptr<Archive>> theArchive = Archive::createArchive(theFullPath);
+            if (!theArchive.isOK()) {
+                anOutput << "Failed to create archive\n";
+                return false;
+            }
+            if (!theArchive.getValue()->addFolder(theTree, nullptr, 2).isOK()) {
+                anOutput << "addFolder failed\n";
+                return false;
+            }
+            std::stringstream theStream;
+            if (theArchive.getValue()->list(theStream).getValue() != theNames.size()) {
+                anOutput << "addFolder didn't add every file\n";
+                return false;
+            }
+            std::string temp(folder + "/out.txt");
+            for (auto& theName : theNames) {
+                theArchive.getValue()->extract(folder + "/" + theName, temp);
+                if (!filesMatch(theName, temp)) {
+                    anOutput << "Extracted file doesn't match original.\n";
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        //-------------------------------------------
+
+        bool doListFolderTests(std::ostream& anOutput) {
+            std::string theFullPath(folder + "/listfoldertest.arc");
+            makeTestTree(folder + "/ltree");
+            ArchiveStatus<std::shared_ptr<Archive>> theArchive = Archive::createArchive(theFullPath);
+            if (!theArchive.isOK()) {
+                anOutput << "Failed to create archive\n";
+                return false;
+            }
+            addTestFiles(*theArchive.getValue());
+            theArchive.getValue()->addFolder(folder + "/ltree");
+            std::stringstream theStream;
+            if (theArchive.getValue()->list(theStream, "ltree/").getValue() != 3 ||
+                theStream.str() != "XlargeA.txt\nnested/\nsmallA.txt\n#\n#\n") {
+                anOutput << "folder listing didn't match: " << theStream.str() << "\n";
+                return false;
+            }
+            std::stringstream theGlobStream;
+            if (theArchive.getValue()->list(theGlobStream, "ltree/nested/l*").getValue() != 1) {
+                anOutput << "glob listing didn't match\n";
+                return false;
+            }
+            return true;
+        }
+
+        //-------------------------------------------
+
+        bool doLongNameTests(std::ostream& anOutput) {
+            std::string theFullPath(folder + "/longnametest.arc");
+            std::string theLongName("a_file_name_well_past_the_thirty_characters_that_used_to_fit.txt");
+            std::filesystem::copy_file(folder + "/mediumA.txt", folder + "/" + theLongName,
+                                       std::filesystem::copy_options::overwrite_existing);
+            {
+                ArchiveStatus<std::shared_ptr<Archive>> theArchive = Archive::createArchive(theFullPath);
+                if (!theArchive.isOK()) {
+                    anOutput << "Failed to create archive\n";
+                    return false;
+                }
+                addTestFiles(*theArchive.getValue());
+                theArchive.getValue()->add(folder + "/" + theLongName);
+            }
+            ArchiveStatus<std::shared_ptr<Archive>> theArchive = Archive::openArchive(theFullPath);
+            if (!theArchive.isOK()) {
+                anOutput << "Failed to open archive\n";
+                return false;
+            }
+            std::stringstream theList;
+            theArchive.getValue()->list(theList);
+            if (theList.str().find(theLongName + "\n") == std::string::npos) {
+                anOutput << "Long name was cut short\n";
+                return false;
+            }
+            std::string temp(folder + "/out.txt");
+            theArchive.getValue()->extract(theLongName, temp);
+            if (!filesMatch(theLongName, temp)) {
+                anOutput << "Extracted file doesn't match original.\n";
+                return false;
+            }
+            return true;
+        }
+
+        //-------------------------------------------
+
+        bool doChecksumTests(std::ostream& anOutput) {
+            std::string theFullPath(folder + "/checksumtest.arc");
+            {
+                ArchiveStatus<std::shared_ptr<Archive>> theArchive = Archive::createArchive(theFullPath);
+                if (!theArchive.isOK()) {
+                    anOutput << "Failed to create archive\n";
+                    return false;
+                }
+                theArchive.getValue()->add(folder + "/mediumA.txt");
+            }
+            {
+                // flip a byte of the file's first block, past its header and name
+                std::fstream theFile(theFullPath, std::ios::in | std::ios::out | std::ios::binary);
+                theFile.seekg(kSuperblockSize + headerSize + 100);
+                char theByte = theFile.get();
+                theFile.seekp(kSuperblockSize + headerSize + 100);
+                theFile.put(theByte ^ 0x20);
+            }
+            ArchiveStatus<std::shared_ptr<Archive>> theArchive = Archive::openArchive(theFullPath);
+            if (!theArchive.isOK()) {
+                anOutput << "Failed to open archive\n";
+                return false;
+            }
+            std::string temp(folder + "/out.txt");
+            if (theArchive.getValue()->extract("mediumA.txt", temp).getError() != ArchiveErrors::badBlockHash) {
+                anOutput << "Corrupted block was not detected\n";
+                return false;
+            }
+            theArchive.getValue()->setChecksumVerification(false);
+            if (!theArchive.getValue()->extract("mediumA.txt", temp).isOK() || filesMatch("mediumA.txt", temp)) {
+                anOutput << "Unverified extract didn't hand back the stored bytes\n";
+                return false;
+            }
+            return true;
+        }
+
+        //-------------------------------------------
+
+        bool doIOBackendTests(std::ostream& anOutput) {
+            std::string theFullPath(folder + "/iobackendtest.arc");
+            std::string theTree(folder + "/iobackendtree");
+            std::vector<std::string> theNames = makeTestTree(theTree);
+            for (auto theType : {IOBackendType::threadPool, IOBackendType::ioUring}) {
+                std::filesystem::remove_all(folder + "/iobackendout");
+                ArchiveStatus<std::shared_ptr<Archive>> theArchive = Archive::createArchive(theFullPath);
+                if (!theArchive.isOK()) {
+                    anOutput << "Failed to create archive\n";
+                    return false;
+                }
+                auto theStatus = theArchive.getValue()->setIOBackend(theType, 4);
+                if (!theStatus.isOK()) {
+                    if (theType == IOBackendType::ioUring) { continue; } // not every kernel allows it
+                    anOutput << "Failed to set the I/O backend\n";
+                    return false;
+                }
+                Compression theProcessor;
+                theArchive.getValue()->add(folder + "/XlargeB.txt", &theProcessor);
+                if (!theArchive.getValue()->addFolder(theTree).isOK() ||
+                    !theArchive.getValue()->extractFolder(theTree, folder + "/iobackendout").isOK()) {
+                    anOutput << "Folder round trip failed\n";
+                    return false;
+                }
+                for (auto& theName : theNames) {
+                    std::string theRelative = theName.substr(theName.find('/') + 1);
+                    if (!filesMatch(theName, folder + "/iobackendout/" + theRelative)) {
+                        anOutput << "Extracted file doesn't match original.\n";
+                        return false;
+                    }
+                }
+                std::string temp(folder + "/out.txt");
+                theArchive.getValue()->extract("XlargeB.txt", temp);
+                if (!filesMatch("XlargeB.txt", temp)) {
+                    anOutput << "Extracted file doesn't match original.\n";
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        //-------------------------------------------
+
+        bool doBufferPoolTests(std::ostream& anOutput) {
+            std::string theFullPath(folder + "/bufferpooltest.arc");
+            std::string temp(folder + "/out.txt");
+            auto theNames = {"mediumA.txt", "largeA.txt", "smallB.txt", "mediumB.txt", "largeB.txt", "XlargeB.txt"};
+            {
+                ArchiveStatus<std::shared_ptr<Archive>> theArchive = Archive::createArchive(theFullPath);
+                if (!theArchive.isOK()) {
+                    anOutput << "Failed to create archive\n";
+                    return false;
+                }
+                // the smallest pool, so scans keep replacing frames
+                if (!theArchive.getValue()->setBufferPool(1).isOK()) {
+                    anOutput << "Failed to set the buffer pool\n";
+                    return false;
+                }
+                Compression theProcessor;
+                addTestFiles(*theArchive.getValue());
+                addTestFiles(*theArchive.getValue(), 'B', &theProcessor);
+                theArchive.getValue()->remove("smallA.txt");
+                theArchive.getValue()->remove("XlargeA.txt");
+                // relinking while blocks move goes through headers held in the pool
+                theArchive.getValue()->compactStep(20);
+                if (!theArchive.getValue()->compact().isOK()) {
+                    anOutput << "compact failed\n";
+                    return false;
+                }
+                for (int thePass = 0; thePass < 2; thePass++) {
+                    for (auto theFileName : theNames) {
+                        theArchive.getValue()->extract(theFileName, temp);
+                        if (!filesMatch(theFileName, temp)) {
+                            anOutput << "Extracted file doesn't match original.\n";
+                            return false;
+                        }
+                    }
+                }
+            }
+            // everything the pool held back has to have reached the file
+            ArchiveStatus<std::shared_ptr<Archive>> theArchive = Archive::openArchive(theFullPath);
+            if (!theArchive.isOK()) {
+                anOutput << "Failed to open archive\n";
+                return false;
+            }
+            for (auto theFileName : theNames) {
+                theArchive.getValue()->extract(theFileName, temp);
+                if (!filesMatch(theFileName, temp)) {
+                    anOutput << "Extracted file doesn't match original.\n";
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        //-------------------------------------------
+
+        bool doDirectIOTests(std::ostream& anOutput) {
+            std::string theFullPath(folder + "/directiotest.arc");
+            std::string temp(folder + "/out.txt");
+            auto theNames = {"smallA.txt", "mediumA.txt", "largeA.txt", "smallB.txt", "mediumB.txt", "XlargeB.txt"};
+            {
+                ArchiveStatus<std::shared_ptr<Archive>> theArchive = Archive::createArchive(theFullPath);
+                if (theArchive.getValue()->setDirectIO(true).getError() != ArchiveErrors::badBlockLength) {
+                    anOutput << "Direct I/O accepted an unaligned block size\n";
+                    return false;
+                }
+            }
+            {
+                ArchiveStatus<std::shared_ptr<Archive>> theArchive = Archive::createArchive(theFullPath, 4096);
+                if (!theArchive.isOK()) {
+                    anOutput << "Failed to create archive\n";
+                    return false;
+                }
+                auto theStatus = theArchive.getValue()->setDirectIO(true);
+                if (theStatus.getError() == ArchiveErrors::badMode) { return true; } // e.g. tmpfs has no O_DIRECT
+                if (!theStatus.isOK()) {
+                    anOutput << "Failed to turn on direct I/O\n";
+                    return false;
+                }
+                Compression theProcessor;
+                addTestFiles(*theArchive.getValue());
+                addTestFiles(*theArchive.getValue(), 'B', &theProcessor);
+                theArchive.getValue()->remove("largeB.txt");
+                theArchive.getValue()->remove("XlargeA.txt");
+                if (!theArchive.getValue()->compact().isOK()) {
+                    anOutput << "compact failed\n";
+                    return false;
+                }
+                // none of the test files is a whole number of aligned blocks, so every tail is partial
+                for (auto theFileName : theNames) {
+                    theArchive.getValue()->extract(theFileName, temp);
+                    if (!filesMatch(theFileName, temp)) {
+                        anOutput << "Extracted file doesn't match original.\n";
+                        return false;
+                    }
+                }
+            }
+            ArchiveStatus<std::shared_ptr<Archive>> theArchive = Archive::openArchive(theFullPath);
+            if (!theArchive.isOK() || !theArchive.getValue()->setDirectIO(true).isOK()) {
+                anOutput << "Failed to reopen archive\n";
+                return false;
+            }
+            for (auto theFileName : theNames) {
+                theArchive.getValue()->extract(theFileName, temp);
+                if (!filesMatch(theFileName, temp)) {
+                    anOutput << "Extracted file doesn't match original.\n";
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        //-------------------------------------------
+
+        bool doExtractFolderTests(std::ostream& anOutput) {
+            std::string theFullPath(folder + "/extractfoldertest.arc");
+            std::vector<std::string> theNames = makeTestTree(folder + "/xtree");
+            ArchiveStatus<std::shared_ptr<Archive>> theArchive = Archive::createArchive(theFullPath);
+            if (!theArchive.isOK()) {
+                anOutput << "Failed to create archive\n";
+                return false;
+            }
+            Compression theProcessor;
+            addTestFile(*theArchive.getValue(), "medium", 'A');
+            theArchive.getValue()->addFolder(folder + "/xtree", &theProcessor);
+            std::string theTarget(folder + "/xtree.out");
+            std::filesystem::remove_all(theTarget);
+            if (!theArchive.getValue()->extractFolder("xtree", theTarget, 2).isOK()) {
+                anOutput << "extractFolder failed\n";
+                return false;
+            }
+            for (auto& theName : theNames) {
+                std::string theExtracted(theTarget + theName.substr(theName.find('/')));
+                if (!filesMatch(theName, theExtracted)) {
+                    anOutput << "Extracted file doesn't match original.\n";
+                    return false;
+                }
+            }
+            if (std::filesystem::exists(theTarget + "/mediumA.txt")) {
+                anOutput << "extractFolder extracted a file outside the folder\n";
+                return false;
+            }
+            return true;
+        }
+
+        //-------------------------------------------
+
+        bool doParallelCompressTests(std::ostream& anOutput) {
+            std::string theFullPath(folder + "/parallelcompresstest.arc");
+            {
+                ArchiveStatus<std::shared_ptr<Archive>> theArchive = Archive::createArchive(theFullPath);
+                if (!theArchive.isOK()) {
+                    anOutput << "Failed to create archive\n";
+                    return false;
+                }
+                // small chunks so that the Xlarge files span several rounds of chunks
+                Compression theProcessor(4, 32 * 1024);
+                addTestFiles(*theArchive.getValue(), 'A', &theProcessor);
+                addTestFiles(*theArchive.getValue(), 'B', &theProcessor);
+            }
+            if (!hasMaxSize(theFullPath, 540288/2)) {
+                anOutput << "Archive is too large\n";
+                return false;
+            }
+            ArchiveStatus<std::shared_ptr<Archive>> theArchive = Archive::openArchive(theFullPath);
+            if (!theArchive.isOK()) {
+                anOutput << "Failed to open archive\n";
+                return false;
+            }
+            std::string temp(folder + "/out.txt");
+            for (auto theFileName : {pickRandomFile(), std::string("XlargeA.txt"), std::string("XlargeB.txt")}) {
+                if (!theArchive.getValue()->extract(theFileName, temp).isOK() || !filesMatch(theFileName, temp)) {
+                    anOutput << "Extracted file doesn't match original.\n";
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        //-------------------------------------------
+
+        bool doReadRangeTests(std::ostream& anOutput) {
+            ArchiveStatus<std::shared_ptr<Archive>> theArchive = Archive::createArchive(folder + "/readrangetest");
+            if (!theArchive.isOK()) {
+                anOutput << "Failed to create archive\n";
+                return false;
+            }
+            Compression theProcessor;
+            addTestFile(*theArchive.getValue(), "Xlarge", 'A');
+            addTestFile(*theArchive.getValue(), "Xlarge", 'B', &theProcessor);
+            for (auto theFileName : {std::string("XlargeA.txt"), std::string("XlargeB.txt")}) {
+                std::ifstream theFile(folder + "/" + theFileName, std::ios::binary);
+                std::string theContents((std::istreambuf_iterator<char>(theFile)), std::istreambuf_iterator<char>());
+                // head, a window across block borders, the tail, and a read past the end
+                std::vector<std::pair<size_t, size_t>> theRanges = {
+                        {0, 100}, {5000, 3000}, {theContents.size() - 500, 1000}, {theContents.size() + 10, 10}
+                };
+                for (auto [theOffset, theLength] : theRanges) {
+                    std::vector<char> theBuffer(theLength);
+                    auto theStatus = theArchive.getValue()->readRange(theFileName, theOffset, theLength, theBuffer.data());
+                    size_t theExpected = theOffset < theContents.size() ?
+                                         std::min(theLength, theContents.size() - theOffset) : 0;
+                    if (!theStatus.isOK() || theStatus.getValue() != theExpected ||
+                        theContents.compare(std::min(theOffset, theContents.size()), theExpected,
+                                            theBuffer.data(), theExpected) != 0) {
+                        anOutput << "readRange returned the wrong bytes for " << theFileName << "\n";
+                        return false;
+                    }
+                }
+            }
+            return true;
+        }
+
+        //-------------------------------------------
+
+        bool doDedupTests(std::ostream& anOutput) {
+            std::string theFullPath(folder + "/deduptest.arc");
+            // a near copy of XlargeA: one edit in the middle
+            std::ifstream theFile(folder + "/XlargeA.txt", std::ios::binary);
+            std::string theContents((std::istreambuf_iterator<char>(theFile)), std::istreambuf_iterator<char>());
+            theContents.insert(theContents.size() / 2, "an edit in the middle");
+            std::ofstream(folder + "/XlargeA2.txt", std::ios::binary) << theContents;
+            {
+                ArchiveStatus<std::shared_ptr<Archive>> theArchive = Archive::createArchive(theFullPath);
+                if (!theArchive.isOK()) {
+                    anOutput << "Failed to create archive\n";
+                    return false;
+                }
+                Deduplication theProcessor(*theArchive.getValue());
+                addTestFile(*theArchive.getValue(), "Xlarge", 'A', &theProcessor);
+                std::stringstream theStream;
+                size_t theFirstCount = theArchive.getValue()->debugDump(theStream).getValue();
+                theArchive.getValue()->add(folder + "/XlargeA2.txt", &theProcessor);
+                size_t theSecondCount = theArchive.getValue()->debugDump(theStream).getValue();
+                if (theSecondCount - theFirstCount > theFirstCount / 4) {
+                    anOutput << "The near copy was not deduplicated\n";
+                    return false;
+                }
+                addTestFile(*theArchive.getValue(), "small", 'A', &theProcessor);
+            }
+            ArchiveStatus<std::shared_ptr<Archive>> theArchive = Archive::openArchive(theFullPath);
+            if (!theArchive.isOK()) {
+                anOutput << "Failed to open archive\n";
+                return false;
+            }
+            std::string temp(folder + "/out.txt");
+            for (auto theFileName : {"XlargeA.txt", "XlargeA2.txt", "smallA.txt"}) {
+                if (!theArchive.getValue()->extract(theFileName, temp).isOK() || !filesMatch(theFileName, temp)) {
+                    anOutput << "Extracted file doesn't match original.\n";
+                    return false;
+                }
+            }
+            // the shared chunks have to outlive the removal of one of the files using them
+            theArchive.getValue()->remove("XlargeA.txt");
+            if (!theArchive.getValue()->extract("XlargeA2.txt", temp).isOK() || !filesMatch("XlargeA2.txt", temp)) {
+                anOutput << "Removing a file broke the chunks it shared\n";
+                return false;
+            }
+            return true;
+        }
+
+        //-------------------------------------------
+
+        bool doAddManyTests(std::ostream& anOutput) {
+            std::string theFullPath(folder + "/addmanytest.arc");
+            {
+                ArchiveStatus<std::shared_ptr<Archive>> theArchive = Archive::createArchive(theFullPath);
+                if (!theArchive.isOK()) {
+                    anOutput << "Failed to create archive\n";
+                    return false;
+                }
+                Compression theProcessor;
+                std::vector<std::string> thePlain, theCompressed;
+                for (auto theName : {"small", "medium", "large", "Xlarge"}) {
+                    thePlain.push_back(folder + "/" + theName + "A.txt");
+                    theCompressed.push_back(folder + "/" + theName + "B.txt");
+                }
+                thePlain.push_back(folder + "/smallA.txt"); // repeated within the batch
+                thePlain.push_back(folder + "/missing.txt");
+                if (theArchive.getValue()->addMany(thePlain, nullptr, 4).getValue() != 4 ||
+                    theArchive.getValue()->addMany(theCompressed, &theProcessor, 3).getValue() != 4) {
+                    anOutput << "addMany added the wrong number of files\n";
+                    return false;
+                }
+                if (theArchive.getValue()->addMany({folder + "/largeB.txt"}).getValue() != 0) {
+                    anOutput << "addMany accepted a file that is already archived\n";
+                    return false;
+                }
+            }
+            ArchiveStatus<std::shared_ptr<Archive>> theArchive = Archive::openArchive(theFullPath);
+            if (!theArchive.isOK()) {
+                anOutput << "Failed to open archive\n";
+                return false;
+            }
+            std::stringstream theStream;
+            if (theArchive.getValue()->list(theStream).getValue() != 8) {
+                anOutput << "Archive doesn't have enough elements\n";
+                return false;
+            }
+            std::string temp(folder + "/out.txt");
+            for (auto theName : {"small", "medium", "large", "Xlarge"}) {
+                for (char theChar : {'A', 'B'}) {
+                    std::string theFileName = std::string(theName) + theChar + ".txt";
+                    theArchive.getValue()->extract(theFileName, temp);
+                    if (!filesMatch(theFileName, temp)) {
+                        anOutput << "Extracted file doesn't match original.\n";
+                        return false;
+                    }
+                }
+            }
+            return true;
+        }
+
     };
 
 
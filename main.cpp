@@ -37,6 +37,22 @@ int main(int argc, const char * argv[]) {
                 {"Dump",    [&](){return theTester.doDumpTests(theOutput);}  },
                 {"Stress",  [&](){return theTester.doStressTests(theOutput);}  },
                 {"Compress",  [&](){return theTester.doCompressTests(theOutput);}  },
+                {"Resize",  [&](){return theTester.doResizeTests(theOutput);}  },
+                {"Compact", [&](){return theTester.doCompactTests(theOutput);}  },
+                {"IncrementalCompact", [&](){return theTester.doIncrementalCompactTests(theOutput);}  },
+                {"Merge",   [&](){return theTester.doMergeTests(theOutput);}  },
+                {"AddFolder", [&](){return theTester.doAddFolderTests(theOutput);}  },
+                {"ExtractFolder", [&](){return theTester.doExtractFolderTests(theOutput);}  },
+                {"ListFolder", [&](){return theTester.doListFolderTests(theOutput);}  },
+                {"LongName", [&](){return theTester.doLongNameTests(theOutput);}  },
+                {"Checksum", [&](){return theTester.doChecksumTests(theOutput);}  },
+                {"IOBackend", [&](){return theTester.doIOBackendTests(theOutput);}  },
+                {"BufferPool", [&](){return theTester.doBufferPoolTests(theOutput);}  },
+                {"DirectIO", [&](){return theTester.doDirectIOTests(theOutput);}  },
+                {"AddMany", [&](){return theTester.doAddManyTests(theOutput);}  },
+                {"ParallelCompress", [&](){return theTester.doParallelCompressTests(theOutput);}  },
+                {"ReadRange", [&](){return theTester.doReadRangeTests(theOutput);}  },
+                {"Dedup",   [&](){return theTester.doDedupTests(theOutput);}  },
                 {"All",     [&](){return theTester.doAllTests(theOutput);}  },
         };
 